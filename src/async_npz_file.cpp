@@ -0,0 +1,225 @@
+#include "async_npz_file.h"
+#include "parallel.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+
+using namespace cnpz;
+using std::string;
+
+namespace {
+// Each copy thread takes blocks of this size
+const size_t COPY_BLOCK_SIZE = 4 << 20;
+// Snapshots from this size bypass the cache, they would only evict the caller's working set
+const size_t NON_TEMPORAL_MIN_SIZE = 1 << 20;
+
+void copy_block(char* dst, const char* src, size_t size, bool non_temporal)
+{
+#ifdef __SSE2__
+    if (non_temporal) {
+        size_t head = std::min(size, (16 - reinterpret_cast<uintptr_t>(dst) % 16) % 16);
+        std::memcpy(dst, src, head);
+        size_t i = head;
+        for (; i + 64 <= size; i += 64) {
+            __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+            __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i + 16));
+            __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i + 32));
+            __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i + 48));
+            _mm_stream_si128(reinterpret_cast<__m128i*>(dst + i), a);
+            _mm_stream_si128(reinterpret_cast<__m128i*>(dst + i + 16), b);
+            _mm_stream_si128(reinterpret_cast<__m128i*>(dst + i + 32), c);
+            _mm_stream_si128(reinterpret_cast<__m128i*>(dst + i + 48), d);
+        }
+        std::memcpy(dst + i, src + i, size - i);
+        _mm_sfence();  // Streaming stores are weakly ordered, the buffer goes to another thread
+        return;
+    }
+#endif
+    (void)non_temporal;
+    std::memcpy(dst, src, size);
+}
+}
+
+AsyncNpzFile::AsyncNpzFile(const string& filename, size_t max_queued_bytes, size_t num_workers, OpenMode mode)
+:
+    npz_{filename, mode},
+    max_queued_bytes_{max_queued_bytes}
+{
+    // NpzFile takes concurrent writers, the workers each compress their own entry
+    npz_.set_num_threads(1);
+    try {
+        for (size_t i = 0; i < std::max<size_t>(num_workers, 1); ++i) {
+            workers_.emplace_back([this]() { run(); });
+        }
+    } catch (...) {
+        {
+            std::lock_guard lock(mutex_);
+            stopping_ = true;
+            work_available_.notify_all();
+        }
+        workers_.clear();
+        throw;
+    }
+}
+
+AsyncNpzFile::~AsyncNpzFile()
+{
+    try {
+        close();
+    } catch (...) {
+        // Call close() explicitly to see errors
+    }
+}
+
+size_t AsyncNpzFile::queued_bytes() const
+{
+    std::lock_guard lock(mutex_);
+    return queued_bytes_;
+}
+
+size_t AsyncNpzFile::pooled_bytes() const
+{
+    std::lock_guard lock(mutex_);
+    return pooled_bytes_;
+}
+
+std::vector<char> AsyncNpzFile::snapshot(const char* data, size_t size)
+{
+    std::vector<char> buffer;
+    {
+        // Only an idle buffer of the same size: reserve() counted size bytes, not a larger buffer's
+        std::lock_guard lock(mutex_);
+        auto it = std::find_if(pool_.begin(), pool_.end(), [&](const auto& idle) { return idle.size() == size; });
+        if (it != pool_.end()) {
+            buffer = std::move(*it);
+            pool_.erase(it);
+            pooled_bytes_ -= buffer.size();
+            npz_.memory_budget().release(buffer.size());  // Counted by reserve() from now on
+        }
+    }
+    if (buffer.empty()) {
+        buffer.resize(size);
+    }
+    bool non_temporal = size >= NON_TEMPORAL_MIN_SIZE;
+    size_t num_blocks = (size + COPY_BLOCK_SIZE - 1) / COPY_BLOCK_SIZE;
+    parallel_for(num_blocks, copy_threads_, [&](size_t i) {
+        size_t offset = i * COPY_BLOCK_SIZE;
+        copy_block(buffer.data() + offset, data + offset, std::min(COPY_BLOCK_SIZE, size - offset), non_temporal);
+    });
+    return buffer;
+}
+
+void AsyncNpzFile::recycle(std::vector<char>&& buffer)
+{
+    std::lock_guard lock(mutex_);
+    if (!buffer.empty() && pooled_bytes_ + buffer.size() <= max_queued_bytes_ &&
+        npz_.memory_budget().try_acquire(buffer.size())) {
+        pooled_bytes_ += buffer.size();
+        pool_.push_back(std::move(buffer));
+    }
+}
+
+void AsyncNpzFile::drop_pool()
+{
+    std::vector<std::vector<char>> pool;
+    {
+        std::lock_guard lock(mutex_);
+        pool.swap(pool_);
+        npz_.memory_budget().release(std::exchange(pooled_bytes_, 0));
+    }
+}
+
+void AsyncNpzFile::rethrow_error()
+{
+    if (error_) {
+        std::rethrow_exception(std::exchange(error_, nullptr));
+    }
+}
+
+void AsyncNpzFile::reserve(size_t size)
+{
+    std::unique_lock lock(mutex_);
+    if (stopping_) {
+        throw std::runtime_error("Archive is closed: " + npz_.filename());
+    }
+    state_changed_.wait(lock, [&]() {
+        return error_ || queued_bytes_ == 0 || queued_bytes_ + size <= max_queued_bytes_;
+    });
+    rethrow_error();
+    queued_bytes_ += size;
+    lock.unlock();
+    // Idle buffers give way to queued data
+    MemoryBudget& budget = npz_.memory_budget();
+    if (!budget.try_acquire(size)) {
+        drop_pool();
+        budget.acquire(size);
+    }
+}
+
+void AsyncNpzFile::release(size_t size)
+{
+    npz_.memory_budget().release(size);
+    std::lock_guard lock(mutex_);
+    queued_bytes_ -= size;
+    state_changed_.notify_all();
+}
+
+void AsyncNpzFile::push(size_t size, Task task)
+{
+    std::lock_guard lock(mutex_);
+    queue_.emplace_back(size, std::move(task));
+    work_available_.notify_one();
+}
+
+void AsyncNpzFile::run()
+{
+    std::unique_lock lock(mutex_);
+    while (true) {
+        work_available_.wait(lock, [this]() { return stopping_ || !queue_.empty(); });
+        if (queue_.empty()) return;
+        auto [size, task] = std::move(queue_.front());
+        queue_.pop_front();
+        ++active_;
+        lock.unlock();
+        std::exception_ptr error;
+        try {
+            task(npz_);
+        } catch (...) {
+            error = std::current_exception();
+        }
+        task = nullptr;  // Frees the data before giving the budget back
+        npz_.memory_budget().release(size);
+        lock.lock();
+        if (error && !error_) error_ = error;
+        --active_;
+        queued_bytes_ -= size;
+        state_changed_.notify_all();
+    }
+}
+
+void AsyncNpzFile::flush()
+{
+    std::unique_lock lock(mutex_);
+    state_changed_.wait(lock, [this]() { return queue_.empty() && active_ == 0; });
+    rethrow_error();
+}
+
+void AsyncNpzFile::close()
+{
+    {
+        std::unique_lock lock(mutex_);
+        if (stopping_) return;
+        state_changed_.wait(lock, [this]() { return queue_.empty() && active_ == 0; });
+        stopping_ = true;
+        work_available_.notify_all();
+    }
+    workers_.clear();  // Joins
+    drop_pool();
+    std::exception_ptr error = std::exchange(error_, nullptr);
+    npz_.close();
+    if (error) std::rethrow_exception(error);
+}
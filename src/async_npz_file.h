@@ -0,0 +1,111 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <numeric>
+#include <string>
+#include <thread>
+#include <vector>
+#include "cnpz.h"
+
+namespace cnpz {
+    // NpzFile written in the background: add_array queues the array and returns, num_workers threads do the
+    // CRC, compression and I/O. Queued data counts against max_queued_bytes, add_array blocks until there is
+    // room (a single larger array is let through when the queue is empty). With several workers, entries land
+    // in the archive in completion order. The first background error is thrown by the next call
+    class AsyncNpzFile {
+    public:
+        explicit AsyncNpzFile(const std::string& filename, size_t max_queued_bytes = size_t(256) << 20,
+                              size_t num_workers = 1, OpenMode mode = OpenMode::TRUNCATE);
+        ~AsyncNpzFile();
+        AsyncNpzFile(const AsyncNpzFile&) = delete;
+        AsyncNpzFile& operator=(const AsyncNpzFile&) = delete;
+
+        // For settings such as the compression policy, before the first add_array
+        inline NpzFile& file() { return npz_; }
+
+        // Copies data into a recycled buffer, on copy_threads() threads and with non-temporal stores for large
+        // arrays, and returns: data can be reused right away. The copy is compressed and written in the background
+        template<typename T>
+        void add_array_snapshot(const std::string& name, const T* data, const shape_type& shape, time_t timestamp = 0,
+                                CompressionMethod compression = CompressionMethod::STORED,
+                                const filter_list& filters = {}) {
+            size_t size = std::accumulate(shape.begin(), shape.end(), sizeof(T), std::multiplies<size_t>());
+            reserve(size);
+            std::vector<char> copy;
+            try {
+                copy = snapshot(reinterpret_cast<const char*>(data), size);
+            } catch (...) {
+                release(size);
+                throw;
+            }
+            push(size, [=, this, copy = std::move(copy)](NpzFile& npz) mutable {
+                npz.add_array(name, reinterpret_cast<const T*>(copy.data()), shape, timestamp, compression, filters);
+                recycle(std::move(copy));
+            });
+        }
+        // Same as add_array_snapshot
+        template<typename T>
+        void add_array(const std::string& name, const T* data, const shape_type& shape, time_t timestamp = 0,
+                       CompressionMethod compression = CompressionMethod::STORED, const filter_list& filters = {}) {
+            add_array_snapshot(name, data, shape, timestamp, compression, filters);
+        }
+        // Takes data over, without a copy
+        template<typename T>
+        void add_array(const std::string& name, std::vector<T>&& data, const shape_type& shape, time_t timestamp = 0,
+                       CompressionMethod compression = CompressionMethod::STORED, const filter_list& filters = {}) {
+            static_assert(!std::is_same_v<T, bool>, "std::vector<bool> has no contiguous storage");
+            size_t size = data.size() * sizeof(T);
+            reserve(size);
+            push(size, [=, data = std::move(data)](NpzFile& npz) {
+                npz.add_array(name, data.data(), shape, timestamp, compression, filters);
+            });
+        }
+
+        // Waits until everything queued is written
+        void flush();
+        // Flushes, stops the workers and closes the archive
+        void close();
+
+        inline size_t max_queued_bytes() const { return max_queued_bytes_; }
+        size_t queued_bytes() const;
+        // Idle snapshot buffers kept for reuse, at most max_queued_bytes and dropped when the memory budget is short
+        size_t pooled_bytes() const;
+
+        inline void set_copy_threads(size_t copy_threads) { copy_threads_ = std::max<size_t>(copy_threads, 1); }
+        inline size_t copy_threads() const { return copy_threads_; }
+    private:
+        using Task = std::function<void(NpzFile&)>;
+        // Blocks until size bytes fit in max_queued_bytes and the archive's memory budget and counts them, throws a
+        // pending background error
+        void reserve(size_t size);
+        void release(size_t size);
+        void push(size_t size, Task task);
+        void run();
+        // Pooled buffer of exactly size bytes holding a copy of data
+        std::vector<char> snapshot(const char* data, size_t size);
+        // Idle buffers are counted against the memory budget while pooled
+        void recycle(std::vector<char>&& buffer);
+        void drop_pool();
+        void rethrow_error();  // Needs mutex_
+
+        NpzFile npz_;
+        size_t max_queued_bytes_;
+        mutable std::mutex mutex_;
+        std::condition_variable work_available_;
+        std::condition_variable state_changed_;  // Budget released or a task done
+        std::deque<std::pair<size_t, Task>> queue_;
+        size_t queued_bytes_{0};
+        size_t active_{0};
+        bool stopping_{false};
+        std::exception_ptr error_;
+        std::vector<std::vector<char>> pool_;
+        size_t pooled_bytes_{0};
+        size_t copy_threads_{std::max(1u, std::thread::hardware_concurrency())};
+        std::vector<std::jthread> workers_;
+    };
+}
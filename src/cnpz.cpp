@@ -1,128 +1,187 @@
 #include "cnpz.h"
+#include "filters.h"
+#include "npz_reader.h"
+#include "parallel.h"
+#include "xxhash64.h"
+#include "zip_format.h"
 #include <zlib.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <charconv>
 #include <cassert>
+#include <cerrno>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
 #include <ctime>
 #include <vector>
 #include <numeric>
 #include <filesystem>
+#include <optional>
+#include <thread>
+#include <tuple>
+#include <utility>
 
 using namespace cnpz;
 using std::string;
 namespace fs = std::filesystem;
 
-#define PACKED_STRUCT struct __attribute__((packed))
-
-// These struct rely on little-endian byte order
-
-const uint32_t ZIP_LOCAL_FILE_HEADER_SIG = 0x04034b50;  //PK\3\4
-const uint32_t ZIP_CENTRAL_DIRECTORY_FILE_HEADER_SIG = 0x02014b50;  //PK\1\2
-const uint16_t VERSION_MADE_BY = 20;  // Everyone uses 20
-
-// Zip local file header
-// Structure is:
-//   uint32_t ZIP_LOCAL_FILE_HEADER_SIG
-//   fields from ZipLocalFileHeader
-//   filename
-//   extra field
-PACKED_STRUCT ZipLocalFileHeader {
-    uint16_t version_needed_to_extract{VERSION_MADE_BY};
-    uint16_t general_purpose_bit_flag{0};
-    uint16_t compression_method{static_cast<uint16_t>(CompressionMethod::STORED)};
-    uint16_t last_mod_file_time{0};
-    uint16_t last_mod_file_date{0};
-    uint32_t crc32{0};
-    uint32_t compressed_size{0};
-    uint32_t uncompressed_size{0};
-    uint16_t filename_length{0};
-    uint16_t extra_field_length{0};
-};
-
-// Zip central directory file header
-// Structure is:
-//   uint32_t ZIP_CENTRAL_DIRECTORY_FILE_HEADER_SIG
-//   uint16_t version_made_by{20};
-//   fields from ZipLocalFileHeader
-//   fields from ZipCentralDirectoryFileHeaderSuffix
-//   filename
-//   extra field
-PACKED_STRUCT ZipCentralDirectoryFileHeaderSuffix {
-    uint16_t file_comment_length{0};
-    uint16_t disk_number_start{0};
-    uint16_t internal_file_attr{0};
-    uint32_t external_file_attr{0};
-    uint32_t relative_offset_of_local_header{0};
-};
-
-// Zip end of central directory record
-PACKED_STRUCT ZipEndOfCentralDirectoryRecord {
-    uint32_t signature{0x06054b50};
-    uint16_t disk_number{0};
-    uint16_t central_directory_disk_number{0};
-    uint16_t num_entries_on_disk{0};
-    uint16_t num_entries_total{0};
-    uint32_t central_directory_size{0};
-    uint32_t central_directory_offset{0};
-    uint16_t comment_size{0};
-};
-
 // Helper functions
 
-string filename_with_extension(const string& filename, const string& extension)
+string filename_with_extension(const string& filename, std::string_view extension)
 {
-    return filename.ends_with(extension) ? filename : filename + extension;
+    if (filename.ends_with(extension)) return filename;
+    string full;
+    full.reserve(filename.size() + extension.size());
+    full += filename;
+    full += extension;
+    return full;
+}
+
+// Without the temporary string of std::to_string
+inline void append_decimal(string& s, size_t value)
+{
+    char buf[20];
+    s.append(buf, std::to_chars(buf, buf + sizeof(buf), value).ptr);
 }
 
 // These assume little-endian
-inline void write2(std::ostream& os, uint16_t value)
+inline void write2(string& s, uint16_t value)
+{
+    s.append(reinterpret_cast<const char*>(&value), 2);
+}
+
+inline void write4(string& s, uint32_t value)
 {
-    os.write(reinterpret_cast<const char*>(&value), 2);
+    s.append(reinterpret_cast<const char*>(&value), 4);
 }
 
-inline void write4(std::ostream& os, uint32_t value)
+std::string cnpz::make_record_descr(std::vector<RecordField> fields, size_t record_size)
 {
-    os.write(reinterpret_cast<const char*>(&value), 4);
+    std::sort(fields.begin(), fields.end(), [](const RecordField& a, const RecordField& b) {
+        return a.offset < b.offset;
+    });
+    string descr = "[";
+    size_t offset = 0;
+    auto add_padding = [&](size_t size) {
+        if (size == 0) return;
+        if (descr.size() > 1) descr += ", ";
+        descr += "('', '|V";
+        append_decimal(descr, size);
+        descr += "')";
+    };
+    for (const RecordField& field : fields) {
+        if (field.offset < offset || field.offset + field.size > record_size) {
+            throw std::invalid_argument("Overlapping record field: " + string(field.name));
+        }
+        add_padding(field.offset - offset);
+        if (descr.size() > 1) descr += ", ";
+        descr += "('";
+        descr += field.name;
+        descr += "', ";
+        descr += field.descr;
+        descr += ")";
+        offset = field.offset + field.size;
+    }
+    add_padding(record_size - offset);
+    descr += "]";
+    return descr;
 }
 
-// NPY
-const uint32_t NPY_ARRAY_ALIGN = 64;  // Seems at some point NPY switched from 16 to 64
+// Deflate settings ordered from fastest to strongest, walked by the adaptive policy
+struct DeflateSetting {
+    int level;
+    int strategy;
+};
 
-PACKED_STRUCT NpyHeader {
-    char magic[6] = {'\x93', 'N', 'U', 'M', 'P', 'Y'};   // File name (8 bytes)
-    char major_version = 1;  // Major version
-    char minor_version = 0;  // Minor version
-    uint16_t header_len = 0;   // uint32_t in NPY 2.0 (vs uint16_t in NPY 1.0)
+const DeflateSetting DEFLATE_SETTINGS[] = {
+    {1, Z_HUFFMAN_ONLY}, {1, Z_RLE},
+    {1, Z_DEFAULT_STRATEGY}, {2, Z_DEFAULT_STRATEGY}, {3, Z_DEFAULT_STRATEGY},
+    {4, Z_DEFAULT_STRATEGY}, {5, Z_DEFAULT_STRATEGY}, {6, Z_DEFAULT_STRATEGY},
+    {7, Z_DEFAULT_STRATEGY}, {8, Z_DEFAULT_STRATEGY}, {9, Z_DEFAULT_STRATEGY},
 };
+const int NUM_DEFLATE_SETTINGS = sizeof(DEFLATE_SETTINGS) / sizeof(DeflateSetting);
 
-namespace cnpz {
-    template<> std::string numpy_descr<int8_t>() { return "|i1"; }
-    template<> std::string numpy_descr<int16_t>() { return "<i2"; }
-    template<> std::string numpy_descr<int32_t>() { return "<i4"; }
-    template<> std::string numpy_descr<int64_t>() { return "<i8"; }
-    template<> std::string numpy_descr<uint8_t>() { return "|u1"; }
-    template<> std::string numpy_descr<uint16_t>() { return "<u2"; }
-    template<> std::string numpy_descr<uint32_t>() { return "<u4"; }
-    template<> std::string numpy_descr<uint64_t>() { return "<u8"; }
-    template<> std::string numpy_descr<float>() { return "<f4"; }
-    template<> std::string numpy_descr<double>() { return "<f8"; }
-    template<> std::string numpy_descr<char>() { return "|S1"; }
-    template<> std::string numpy_descr<std::complex<float>>() { return "<c8"; }
-    template<> std::string numpy_descr<std::complex<double>>() { return "<c16"; }
+int setting_index_for_level(int level)
+{
+    if (level < 0) level = 6;  // What Z_DEFAULT_COMPRESSION maps to
+    return std::clamp(level + 1, 0, NUM_DEFLATE_SETTINGS - 1);
 }
 
 // NpzFile
-NpzFile::NpzFile(const string& filename)
+// Large DEFLATE entries are compressed in blocks of this size on several threads
+const size_t SPLIT_BLOCK_SIZE = 1 << 20;
+// Distinct (dtype, shape) headers kept by an archive, replaced oldest first
+const size_t NPY_HEADER_CACHE_SIZE = 16;
+// Central directory space reserved ahead, so it grows in few steps
+const size_t CENTRAL_DIRECTORY_RESERVE = 64 << 10;
+// Most small entries a worker takes at once
+const size_t MAX_BATCH_ENTRIES = 256;
+// zlib deflate state for windowBits 15 and memLevel 9, counted against the memory budget
+const size_t DEFLATE_STATE_SIZE = (1 << 17) + (1 << 18) + (8 << 10);
+
+NpzFile::NpzFile(const string& filename, OpenMode mode)
 :
     filename_{filename.ends_with(".zip") ? filename : filename_with_extension(filename, ".npz")},
-    fs_{filename_, std::ios::binary}
+    fd_{::open(filename_.c_str(), (mode == OpenMode::APPEND ? O_RDWR : O_WRONLY | O_TRUNC) | O_CREAT | O_CLOEXEC,
+               0644)},
+    setting_index_{setting_index_for_level(policy_.level)}
 {
-    if (!fs_.is_open()) {
+    if (fd_ < 0) {
         throw std::runtime_error("Failed to open file: " + filename_);
     }
+    if (mode == OpenMode::APPEND) {
+        try {
+            load_existing_entries();
+        } catch (...) {
+            ::close(fd_);
+            throw;
+        }
+    }
+}
+
+void NpzFile::load_existing_entries()
+{
+    struct stat st;
+    if (fstat(fd_, &st) != 0) {
+        throw std::runtime_error("Failed to stat file: " + filename_);
+    }
+    if (st.st_size == 0) return;  // New archive
+
+    string central_dir;
+    ZipEndOfCentralDirectoryRecord eocd = read_central_directory(fd_, filename_, central_dir);
+    for (const ZipEntry& entry : parse_central_directory(central_dir, eocd.num_entries_total, filename_)) {
+        if (entry.name == ".zgroup") wrote_zarr_group_ = true;
+    }
+    central_dir_.reserve(central_dir.size() + CENTRAL_DIRECTORY_RESERVE);
+    central_dir_ += central_dir;
+    num_entries_ = eocd.num_entries_total;
+    // New entries overwrite the old central directory, close() truncates whatever is left of it
+    offset_ = eocd.central_directory_offset;
+    if (::lseek(fd_, offset_, SEEK_SET) < 0) {
+        throw std::runtime_error("Failed to seek in: " + filename_);
+    }
+}
+
+NpzFile::NpzFile(int fd)
+:
+    filename_{"/dev/fd/" + std::to_string(fd)},
+    fd_{fd},
+    owns_fd_{false},
+    streaming_{true},
+    setting_index_{setting_index_for_level(policy_.level)}
+{
 }
 
 NpzFile::~NpzFile()
 {
-    close();
+    try {
+        close();
+    } catch (...) {
+        // Call close() explicitly to see errors
+    }
 }
 
 std::string NpzFile::full_path() const
@@ -131,166 +190,1466 @@ std::string NpzFile::full_path() const
     return fs::absolute(filename_).string();
 }
 
-void NpzFile::close()
+WorkStealingPool& NpzFile::own_pool()
 {
-    string central_dir = central_dir_.str();
-    uint32_t central_dir_offset = fs_.tellp();
+    std::lock_guard lock(pool_mutex_);
+    if (!pool_) {
+        pool_ = std::make_unique<WorkStealingPool>(num_threads_, cpus_);
+    }
+    return *pool_;
+}
 
+void NpzFile::close()
+{
+    if (open_appender_) {
+        open_appender_->close();
+    }
+    {
+        // Joined before taking write_mutex_, which our tasks may be waiting for
+        std::lock_guard pool_lock(pool_mutex_);
+        pool_.reset();
+    }
+    std::unique_lock lock(write_mutex_);
+    writes_done_.wait(lock, [this]() { return writes_in_flight_ == 0; });
+    if (fd_ < 0) return;
+    if (write_error_) {
+        // Entries in the central directory were not fully written
+        if (owns_fd_) ::close(fd_);
+        fd_ = -1;
+        std::rethrow_exception(write_error_);
+    }
     ZipEndOfCentralDirectoryRecord eocd;
     eocd.num_entries_on_disk = num_entries_;
     eocd.num_entries_total = num_entries_;
-    eocd.central_directory_size = central_dir.size();
-    eocd.central_directory_offset = central_dir_offset;
-    fs_.write(reinterpret_cast<const char*>(central_dir.c_str()), central_dir.size());
-    fs_.write(reinterpret_cast<const char*>(&eocd), sizeof(eocd));
+    eocd.central_directory_size = central_dir_.size();
+    eocd.central_directory_offset = offset_;
+    central_dir_.append(reinterpret_cast<const char*>(&eocd), sizeof(eocd));  // The archive is done with it
     // TODO: support comments
-    fs_.close();
+    try {
+        write_bytes(central_dir_.data(), central_dir_.size());
+    } catch (...) {
+        if (owns_fd_) ::close(fd_);
+        fd_ = -1;
+        throw;
+    }
+    int fd = std::exchange(fd_, -1);
+    if (!streaming_ && ::ftruncate(fd, offset_) != 0) {
+        if (owns_fd_) ::close(fd);
+        throw std::runtime_error("Failed to truncate: " + filename_);
+    }
+    if (owns_fd_ && ::close(fd) != 0) {
+        throw std::runtime_error("Failed to close: " + filename_);
+    }
+}
+
+void NpzFile::set_compression_policy(const CompressionPolicy& policy)
+{
+    if (policy.level < -1 || policy.level > 9 || policy.block_size == 0) {
+        throw std::invalid_argument("Invalid compression policy");
+    }
+    std::lock_guard lock(policy_mutex_);
+    policy_ = policy;
+    setting_index_ = setting_index_for_level(policy.level);
+    bytes_deflated_ = 0;
 }
 
-void compress_chunk(z_stream *p_strm, const Bytef *source, size_t source_len, Bytef* dest, size_t dest_len, bool finish)
+std::vector<unsigned char> NpzFile::deflate_block(const char* head, size_t head_size, const char* data, size_t size,
+                                                  const char* dictionary, size_t dictionary_size, bool last)
 {
-    p_strm->next_out = dest;
-    p_strm->avail_out = dest_len;
-    p_strm->next_in = (z_const Bytef *)source;
-    p_strm->avail_in = source_len;
+    z_stream strm;
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    auto [level, strategy] = current_setting();
+    if (deflateInit2(&strm, level, Z_DEFLATED, -15, 9, strategy) != Z_OK) {
+        throw std::runtime_error("Failed to initialize zlib");
+    }
+    if (dictionary_size > 0) {
+        deflateSetDictionary(&strm, reinterpret_cast<const Bytef*>(dictionary), dictionary_size);
+    }
+    // Room for all of it in one call, plus the empty stored block of the sync flush
+    std::vector<unsigned char> compressed(deflateBound(&strm, head_size + size) + 16);
+    strm.next_out = compressed.data();
+    strm.avail_out = compressed.size();
+    auto start = std::chrono::steady_clock::now();
+    if (head_size > 0) {
+        strm.next_in = (z_const Bytef *)head;
+        strm.avail_in = head_size;
+        [[maybe_unused]] int ret = deflate(&strm, Z_NO_FLUSH);
+        assert(ret == Z_OK && strm.avail_in == 0);
+    }
+    strm.next_in = (z_const Bytef *)data;
+    strm.avail_in = size;
+    [[maybe_unused]] int ret = deflate(&strm, last ? Z_FINISH : Z_SYNC_FLUSH);
+    assert(ret == (last ? Z_STREAM_END : Z_OK) && strm.avail_in == 0);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    adapt_setting(head_size + size, strm.total_out, seconds);
+    compressed.resize(strm.total_out);
+    deflateEnd(&strm);
+    return compressed;
+}
 
-    int ret = deflate(p_strm, finish ? Z_FINISH : Z_NO_FLUSH);
+bool NpzFile::adaptive() const
+{
+    return policy_.target_throughput > 0 || policy_.deadline != std::chrono::steady_clock::time_point{};
+}
 
-    if (finish) {
-        assert(ret == Z_STREAM_END);
-    } else {
-        assert(ret == Z_OK || ret == Z_BUF_ERROR);
+int NpzFile::current_level() const
+{
+    return current_setting().first;
+}
+
+int NpzFile::current_strategy() const
+{
+    return current_setting().second;
+}
+
+std::pair<int, int> NpzFile::current_setting() const
+{
+    std::lock_guard lock(policy_mutex_);
+    if (!adaptive()) return {policy_.level, policy_.strategy};
+    return {DEFLATE_SETTINGS[setting_index_].level, DEFLATE_SETTINGS[setting_index_].strategy};
+}
+
+double NpzFile::target_throughput() const
+{
+    double target = policy_.target_throughput;
+    if (policy_.deadline != std::chrono::steady_clock::time_point{}) {
+        double remaining_seconds = std::chrono::duration<double>(
+            policy_.deadline - std::chrono::steady_clock::now()).count();
+        size_t remaining_bytes = policy_.expected_total_bytes > bytes_deflated_ ?
+                                 policy_.expected_total_bytes - bytes_deflated_ : 0;
+        // Past the deadline we just go as fast as we can
+        double deadline_target = remaining_seconds > 0 ? remaining_bytes / remaining_seconds : HUGE_VAL;
+        target = std::max(target, deadline_target);
     }
+    return target;
 }
 
+void NpzFile::adapt_setting(size_t bytes_in, size_t bytes_out, double compress_seconds)
+{
+    std::lock_guard lock(policy_mutex_);
+    bytes_deflated_ += bytes_in;
+    if (!adaptive() || bytes_in == 0) return;
 
-size_t NpzFile::add_file_from_buffers(const string& name,
-                                    const char* buf0, size_t size0,
-                                    const char* buf1, size_t size1,
-                                    time_t timestamp, CompressionMethod compression)
+    // The output still has to be written, so account for it at the measured write rate
+    double write_seconds = write_rate_ > 0 ? bytes_out / write_rate_ : 0;
+    double achieved = bytes_in / std::max(compress_seconds + write_seconds, 1e-9);
+    double target = target_throughput();
+
+    if (achieved < target) {
+        // Too slow: if compression dominates go faster, if writing dominates compress harder
+        setting_index_ += compress_seconds >= write_seconds ? -1 : 1;
+    } else if (achieved > 1.5 * target) {
+        setting_index_ += 1;  // Headroom to spend on ratio
+    }
+    setting_index_ = std::clamp(setting_index_, 0, NUM_DEFLATE_SETTINGS - 1);
+}
+
+std::vector<unsigned char> NpzFile::deflate_buffers(const char* buf0, size_t size0, const char* buf1, size_t size1,
+                                                    const DeflateSink& sink)
 {
-    bool use_crc = false;
-    num_entries_++;
-    if (name.size() > 0xffff) {
-        throw std::runtime_error("Filename too long: " + name);
+    z_stream strm;
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    // Block size as of the start of the entry, set_compression_policy() may run meanwhile. Level and strategy
+    // follow the adaptive ladder block by block
+    size_t block_size;
+    {
+        std::lock_guard lock(policy_mutex_);
+        block_size = policy_.block_size;
+    }
+    auto [level, strategy] = current_setting();
+    // Have to use window of -15 to get raw deflate format
+    int ret = deflateInit2(&strm, level, Z_DEFLATED, -15, 9, strategy);
+    if (ret != Z_OK) {
+        throw std::runtime_error("Failed to initialize zlib");
     }
-    uint32_t filename_length = name.size();
 
-    ZipLocalFileHeader local_header;
+    const size_t sink_buffer_size = 256 * 1024;
+    size_t total_size = size0 + (buf1 ? size1 : 0);
+    std::vector<unsigned char> compressed(sink ? std::min<size_t>(compressBound(total_size), sink_buffer_size) :
+                                                 compressBound(total_size));
+    size_t out_pos = 0;
+    // Hands output to the sink or grows the buffer when running out of room.
+    // Flushes between settings changes can exceed compressBound slightly
+    auto make_room = [&]() {
+        if (compressed.size() - out_pos >= 64) {
+            // Enough room
+        } else if (sink) {
+            sink(compressed.data(), out_pos);
+            out_pos = 0;
+        } else {
+            compressed.resize(compressed.size() * 3 / 2 + 64);
+        }
+        strm.next_out = compressed.data() + out_pos;
+        strm.avail_out = compressed.size() - out_pos;
+    };
+
+    const char* bufs[2] = {buf0, buf1};
+    size_t sizes[2] = {size0, buf1 ? size1 : 0};
+    for (int b = 0; b < 2; ++b) {
+        size_t pos = 0;
+        bool last_buf = b == 1 || !buf1;
+        do {
+            size_t block = std::min(block_size, sizes[b] - pos);
+            bool finish = last_buf && pos + block == sizes[b];
+            if (auto setting = current_setting(); setting != std::pair{level, strategy}) {
+                std::tie(level, strategy) = setting;
+                // Flushes the pending block first, which fails with Z_BUF_ERROR until it has room
+                do {
+                    make_room();
+                    ret = deflateParams(&strm, level, strategy);
+                    out_pos = compressed.size() - strm.avail_out;
+                } while (ret == Z_BUF_ERROR);
+                assert(ret == Z_OK);
+            }
+            strm.next_in = (z_const Bytef *)(bufs[b] + pos);
+            strm.avail_in = block;
+            size_t out_before = strm.total_out;
+            auto start = std::chrono::steady_clock::now();
+            do {
+                make_room();
+                ret = deflate(&strm, finish ? Z_FINISH : Z_NO_FLUSH);
+                assert(ret == Z_OK || ret == Z_BUF_ERROR || ret == Z_STREAM_END);
+                out_pos = compressed.size() - strm.avail_out;
+            } while (strm.avail_in > 0 || (finish && ret != Z_STREAM_END));
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            adapt_setting(block, strm.total_out - out_before, seconds);
+            pos += block;
+        } while (pos < sizes[b]);
+        if (last_buf) break;
+    }
+    assert(strm.total_in == total_size);
+    deflateEnd(&strm);
+    if (sink) {
+        if (out_pos > 0) sink(compressed.data(), out_pos);
+        return {};
+    }
+    compressed.resize(out_pos);
+    return compressed;
+}
+
+void set_timestamp(ZipLocalFileHeader& local_header, time_t timestamp)
+{
     if (timestamp == 0) {
         timestamp = std::time(nullptr); // use current time
     }
-    struct tm* utctm = gmtime(&timestamp);
-    local_header.last_mod_file_time = (utctm->tm_hour << 11) + (utctm->tm_min << 5) + (utctm->tm_sec/2);
-    local_header.last_mod_file_date = ((utctm->tm_year-80) << 9) + ((utctm->tm_mon+1) << 5) + utctm->tm_mday;
+    struct tm utctm;
+    gmtime_r(&timestamp, &utctm);  // Entries may be prepared on several threads
+    local_header.last_mod_file_time = (utctm.tm_hour << 11) + (utctm.tm_min << 5) + (utctm.tm_sec/2);
+    local_header.last_mod_file_date = ((utctm.tm_year-80) << 9) + ((utctm.tm_mon+1) << 5) + utctm.tm_mday;
+}
 
-    uint32_t crc = 0u;
-    if (use_crc) {
-        crc32(crc, reinterpret_cast<const Bytef *>(buf0), size0);
-        if (buf1) { crc = crc32(crc, reinterpret_cast<const Bytef *>(buf1), size1); }
+// Entry with CRC computed and data compressed, ready to be written
+struct NpzFile::PreparedEntry {
+    string name;
+    string extra_field;
+    ZipLocalFileHeader local_header;
+    std::vector<unsigned char> compressed;
+    MemoryReservation reservation;  // Held for compressed until written
+    // STORED entries are written from these, which may point into owned
+    const char* buf0{nullptr};
+    size_t size0{0};
+    const char* buf1{nullptr};
+    size_t size1{0};
+    std::vector<char> owned;
+};
+
+// Uncompressed entry for write_entries_parallel
+struct NpzFile::EntrySource {
+    string name;
+    // May point into owned
+    const char* buf0{nullptr};
+    size_t size0{0};
+    const char* buf1{nullptr};
+    size_t size1{0};
+    time_t timestamp{0};
+    CompressionMethod compression{CompressionMethod::STORED};
+    string extra_field;
+    std::vector<char> owned;
+};
+
+NpzFile::PreparedEntry NpzFile::start_entry(const string& name, time_t timestamp, const string& extra_field,
+                                            size_t uncompressed_size)
+{
+    if (name.size() > 0xffff) {
+        throw std::runtime_error("Filename too long: " + name);
     }
-    local_header.crc32 = crc;
+    if (extra_field.size() > 0xffff) {
+        throw std::runtime_error("Extra field too long for: " + name);
+    }
+    PreparedEntry entry;
+    entry.name = name;
+    entry.extra_field = extra_field;
+    ZipLocalFileHeader& local_header = entry.local_header;
+    set_timestamp(local_header, timestamp);
+    local_header.filename_length = name.size();
+    local_header.extra_field_length = extra_field.size();
+    local_header.uncompressed_size = uncompressed_size;
+    return entry;
+}
 
+NpzFile::PreparedEntry NpzFile::prepare_entry(const string& name,
+                                              const char* buf0, size_t size0,
+                                              const char* buf1, size_t size1,
+                                              time_t timestamp, CompressionMethod compression,
+                                              const string& extra_field)
+{
     uint32_t total_size = size0 + (buf1 ? size1 : 0);
-    local_header.filename_length = filename_length;
-    local_header.uncompressed_size = total_size;
+    PreparedEntry entry = start_entry(name, timestamp, extra_field, total_size);
+    ZipLocalFileHeader& local_header = entry.local_header;
+
+    uint32_t crc = crc32(0u, reinterpret_cast<const Bytef *>(buf0), size0);
+    if (buf1) { crc = crc32(crc, reinterpret_cast<const Bytef *>(buf1), size1); }
+    local_header.crc32 = crc;
 
-    std::vector<unsigned char> compressed;
     if (compression == CompressionMethod::DEFLATE) {
         local_header.compression_method = static_cast<uint16_t>(compression);
 
+        entry.compressed = deflate_buffers(buf0, size0, buf1, size1);
+        local_header.compressed_size = entry.compressed.size();
+    } else {
+        local_header.compressed_size = total_size;
+        entry.buf0 = buf0;
+        entry.size0 = size0;
+        entry.buf1 = buf1;
+        entry.size1 = buf1 ? size1 : 0;
+    }
+    return entry;
+}
+
+NpzFile::PreparedEntry NpzFile::prepare_entry(EntrySource&& source)
+{
+    PreparedEntry entry = prepare_entry(source.name, source.buf0, source.size0, source.buf1, source.size1,
+                                        source.timestamp, source.compression, source.extra_field);
+    entry.owned = std::move(source.owned);  // The buffer itself moves, so buf0 and buf1 stay valid
+    return entry;
+}
+
+size_t NpzFile::write_entry(const PreparedEntry& entry)
+{
+    ZipLocalFileHeader local_header = entry.local_header;
+    if (streaming_) {
+        std::lock_guard lock(write_mutex_);
+        if (open_appender_) {
+            throw std::runtime_error("Can't add " + entry.name + " while an appendable array is open");
+        }
+        check_entry_count();
+        uint32_t local_header_offset = offset_;
+        write_local_header(local_header, entry.name, entry.extra_field);
+        if (local_header.compression_method == static_cast<uint16_t>(CompressionMethod::DEFLATE)) {
+            auto start = std::chrono::steady_clock::now();
+            write_bytes(entry.compressed.data(), entry.compressed.size());
+            record_write_rate(entry.compressed.size(), start);
+        } else {
+            write_bytes(entry.buf0, entry.size0);
+            if (entry.buf1) { write_bytes(entry.buf1, entry.size1); }
+        }
+        add_to_central_directory(local_header, entry.name, entry.extra_field, local_header_offset);
+        return local_header.compressed_size;
+    }
+
+    string header = local_header_record(local_header, entry.name, entry.extra_field);
+    uint64_t offset;
+    {
+        // Reserve the range of the entry, other threads write theirs meanwhile
+        std::lock_guard lock(write_mutex_);
+        if (open_appender_) {
+            throw std::runtime_error("Can't add " + entry.name + " while an appendable array is open");
+        }
+        check_entry_count();
+        if (offset_ + header.size() + local_header.compressed_size > UINT32_MAX) {
+            throw std::runtime_error("Archive exceeds 4 GiB (no ZIP64 support): " + filename_);
+        }
+        offset = offset_;
+        offset_ += header.size() + local_header.compressed_size;
+        add_to_central_directory(local_header, entry.name, entry.extra_field, offset);
+        ++writes_in_flight_;
+    }
+    try {
+        write_at(offset, header.data(), header.size());
+        offset += header.size();
+        if (local_header.compression_method == static_cast<uint16_t>(CompressionMethod::DEFLATE)) {
+            auto start = std::chrono::steady_clock::now();
+            write_at(offset, entry.compressed.data(), entry.compressed.size());
+            record_write_rate(entry.compressed.size(), start);
+        } else {
+            write_at(offset, entry.buf0, entry.size0);
+            if (entry.buf1) { write_at(offset + entry.size0, entry.buf1, entry.size1); }
+        }
+    } catch (...) {
+        end_write(std::current_exception());
+        throw;
+    }
+    end_write(nullptr);
+    return local_header.compressed_size;
+}
+
+// zlib allocator handing out a caller's buffer, freed all at once with it
+struct StackArena {
+    char* data;
+    size_t size;
+    size_t used{0};
+};
+
+voidpf arena_alloc(voidpf opaque, uInt items, uInt size)
+{
+    StackArena* arena = static_cast<StackArena*>(opaque);
+    size_t bytes = (size_t(items) * size + 15) & ~size_t(15);
+    if (bytes > arena->size - arena->used) return Z_NULL;
+    voidpf p = arena->data + arena->used;
+    arena->used += bytes;
+    return p;
+}
+
+void arena_free(voidpf, voidpf)
+{
+}
+
+void NpzFile::reserve_entries(size_t count, size_t name_size)
+{
+    size_t record_size = 6 + sizeof(ZipLocalFileHeader) + sizeof(ZipCentralDirectoryFileHeaderSuffix) + name_size;
+    std::lock_guard lock(write_mutex_);
+    central_dir_.reserve(central_dir_.size() + count * record_size);
+}
+
+size_t NpzFile::add_small_array_of_type(std::string_view name, std::string_view type_descr, size_t type_size,
+                                        const char* data, std::span<const size_t> shape, time_t timestamp,
+                                        CompressionMethod compression, NpyHeaderFormatter formatter)
+{
+    // Local header, name, .npy header and data (or as much deflated) in one buffer
+    const size_t max_name_size = 256;
+    const size_t max_npy_header_size = SMALL_NPY_HEADER_CAPACITY;
+    alignas(16) char record[4 + sizeof(ZipLocalFileHeader) + max_name_size + max_npy_header_size +
+                            SMALL_ARRAY_MAX_SIZE];
+    size_t data_size = std::accumulate(shape.begin(), shape.end(), type_size, std::multiplies<size_t>());
+    bool has_extension = name.ends_with(".npy");
+    size_t name_size = name.size() + (has_extension ? 0 : 4);
+    char* npy_header = record + 4 + sizeof(ZipLocalFileHeader) + name_size;
+    size_t npy_header_size = 0;
+    if (data_size <= SMALL_ARRAY_MAX_SIZE && name_size <= max_name_size && !streaming_ && !fingerprint_) {
+        npy_header_size = formatter ? formatter(npy_header, shape) :
+                                      format_npy_header(npy_header, max_npy_header_size, type_descr, shape);
+    }
+    if (npy_header_size == 0) {
+        return add_array_of_type(string(name), type_descr, type_size, data,
+                                 shape_type(shape.begin(), shape.end()), timestamp, compression, {});
+    }
+
+    ZipLocalFileHeader local_header;
+    set_timestamp(local_header, timestamp);
+    local_header.filename_length = name_size;
+    local_header.uncompressed_size = npy_header_size + data_size;
+    uint32_t crc = crc32(0u, reinterpret_cast<const Bytef*>(npy_header), npy_header_size);
+    local_header.crc32 = crc32(crc, reinterpret_cast<const Bytef*>(data), data_size);
+    local_header.compressed_size = local_header.uncompressed_size;
+    if (compression == CompressionMethod::DEFLATE) {
+        // A 512-byte window covers these sizes, the state then fits in a few KiB
+        alignas(16) char arena_buffer[16 << 10];
+        StackArena arena{arena_buffer, sizeof(arena_buffer)};
+        alignas(16) char deflated[max_npy_header_size + SMALL_ARRAY_MAX_SIZE];
         z_stream strm;
-        strm.zalloc = Z_NULL;
-        strm.zfree = Z_NULL;
-        strm.opaque = Z_NULL;
-        // Have to use window of -15 to get raw deflate format
-        int ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 9, Z_DEFAULT_STRATEGY);
-        if (ret != Z_OK) {
+        strm.zalloc = arena_alloc;
+        strm.zfree = arena_free;
+        strm.opaque = &arena;
+        auto [level, strategy] = current_setting();
+        if (deflateInit2(&strm, level, Z_DEFLATED, -9, 1, strategy) != Z_OK) {
             throw std::runtime_error("Failed to initialize zlib");
         }
-
-        // Compress
-        compressed.resize(compressBound(total_size));
-        compress_chunk(&strm, reinterpret_cast<const Bytef*>(buf0), size0,
-                       reinterpret_cast<Bytef*>(compressed.data()), compressed.size(), !buf1);
-        assert(strm.avail_in == 0);
-        size_t compressed_size = strm.total_out;
-
-        if (buf1) {
-            compress_chunk(&strm, reinterpret_cast<const Bytef*>(buf1), size1,
-                           reinterpret_cast<Bytef*>(compressed.data()) + compressed_size, compressed.size() - compressed_size, true);
-            compressed_size = strm.total_out;
+        // Output stops short of the stored size, anything longer is stored instead
+        strm.next_out = reinterpret_cast<Bytef*>(deflated);
+        strm.avail_out = local_header.uncompressed_size - 1;
+        strm.next_in = reinterpret_cast<z_const Bytef*>(npy_header);
+        strm.avail_in = npy_header_size;
+        int ret = deflate(&strm, Z_NO_FLUSH);
+        if (ret == Z_OK) {
+            strm.next_in = reinterpret_cast<z_const Bytef*>(const_cast<char*>(data));
+            strm.avail_in = data_size;
+            ret = deflate(&strm, Z_FINISH);
+        }
+        {
+            // Counted for the deadline but not timed, the ladder would only pick up noise from buffers this small
+            std::lock_guard lock(policy_mutex_);
+            bytes_deflated_ += local_header.uncompressed_size;
+        }
+        if (ret == Z_STREAM_END) {
+            local_header.compression_method = static_cast<uint16_t>(CompressionMethod::DEFLATE);
+            local_header.compressed_size = strm.total_out;
+            std::memcpy(npy_header, deflated, strm.total_out);
         }
         deflateEnd(&strm);
-        compressed.resize(compressed_size);
-        local_header.compressed_size = compressed_size;
-        assert(strm.total_in == total_size);
-    } else {
-        local_header.compressed_size = total_size;
     }
+    if (local_header.compression_method == static_cast<uint16_t>(CompressionMethod::STORED)) {
+        std::memcpy(npy_header + npy_header_size, data, data_size);
+    }
+    uint32_t sig = ZIP_LOCAL_FILE_HEADER_SIG;
+    std::memcpy(record, &sig, 4);
+    std::memcpy(record + 4, &local_header, sizeof(local_header));
+    char* full_name = record + 4 + sizeof(local_header);
+    std::memcpy(full_name, name.data(), name.size());
+    if (!has_extension) std::memcpy(full_name + name.size(), ".npy", 4);
+    size_t record_size = 4 + sizeof(local_header) + name_size + local_header.compressed_size;
 
-    // Write local header
-    uint32_t local_header_offset = fs_.tellp();
-    write4(fs_, ZIP_LOCAL_FILE_HEADER_SIG);
-    fs_.write(reinterpret_cast<const char*>(&local_header), sizeof(local_header));
-    fs_.write(name.c_str(), filename_length);
-    if (compression == CompressionMethod::DEFLATE) {
-        fs_.write(reinterpret_cast<const char*>(compressed.data()), compressed.size());
+    uint64_t offset;
+    {
+        std::lock_guard lock(write_mutex_);
+        if (open_appender_) {
+            throw std::runtime_error("Can't add " + string(name) + " while an appendable array is open");
+        }
+        check_entry_count();
+        if (offset_ + record_size > UINT32_MAX) {
+            throw std::runtime_error("Archive exceeds 4 GiB (no ZIP64 support): " + filename_);
+        }
+        offset = offset_;
+        offset_ += record_size;
+        add_to_central_directory(local_header, {full_name, name_size}, {}, offset);
+        ++writes_in_flight_;
+    }
+    try {
+        write_at(offset, record, record_size);
+    } catch (...) {
+        end_write(std::current_exception());
+        throw;
+    }
+    end_write(nullptr);
+    return local_header.compressed_size;
+}
+
+void NpzFile::end_write(std::exception_ptr error)
+{
+    std::lock_guard lock(write_mutex_);
+    if (error && !write_error_) write_error_ = error;
+    --writes_in_flight_;
+    writes_done_.notify_all();
+}
+
+size_t NpzFile::write_entry_streamed(const string& name, const char* buf0, size_t size0,
+                                     const char* buf1, size_t size1, time_t timestamp,
+                                     const string& extra_field)
+{
+    // Compresses under the lock, the output is sequential anyway
+    std::lock_guard lock(write_mutex_);
+    if (open_appender_) {
+        throw std::runtime_error("Can't add " + name + " while an appendable array is open");
+    }
+    check_entry_count();
+    if (name.size() > 0xffff || extra_field.size() > 0xffff) {
+        throw std::runtime_error("Filename or extra field too long: " + name);
+    }
+    ZipLocalFileHeader local_header;
+    set_timestamp(local_header, timestamp);
+    local_header.compression_method = static_cast<uint16_t>(CompressionMethod::DEFLATE);
+    local_header.filename_length = name.size();
+    local_header.extra_field_length = extra_field.size();
+    if (streaming_) {
+        // Zero until the data descriptor
+        local_header.general_purpose_bit_flag |= ZIP_FLAG_DATA_DESCRIPTOR;
+    }
+    uint32_t local_header_offset = offset_;
+    write_local_header(local_header, name, extra_field);
+
+    // Compressed output goes out as it is produced, sizes and CRC follow in the data descriptor or are
+    // patched into the local header
+    size_t compressed_size = 0;
+    deflate_buffers(buf0, size0, buf1, size1, [&](const unsigned char* data, size_t size) {
+        auto start = std::chrono::steady_clock::now();
+        write_bytes(data, size);
+        record_write_rate(size, start);
+        compressed_size += size;
+    });
+    uint32_t crc = crc32(0u, reinterpret_cast<const Bytef *>(buf0), size0);
+    if (buf1) { crc = crc32(crc, reinterpret_cast<const Bytef *>(buf1), size1); }
+    local_header.crc32 = crc;
+    local_header.compressed_size = compressed_size;
+    local_header.uncompressed_size = size0 + (buf1 ? size1 : 0);
+    if (streaming_) {
+        write_data_descriptor(local_header);
     } else {
-        fs_.write(buf0, size0);
-        if (buf1) { fs_.write(buf1, size1); }
+        write_at(local_header_offset + 4, &local_header, sizeof(local_header));
+    }
+
+    add_to_central_directory(local_header, name, extra_field, local_header_offset);
+    return compressed_size;
+}
+
+string NpzFile::local_header_record(const ZipLocalFileHeader& local_header, const string& name,
+                                    const string& extra_field) const
+{
+    string buf;
+    buf.reserve(4 + sizeof(local_header) + name.size() + extra_field.size());
+    write4(buf, ZIP_LOCAL_FILE_HEADER_SIG);
+    buf.append(reinterpret_cast<const char*>(&local_header), sizeof(local_header));
+    buf += name;
+    buf += extra_field;
+    return buf;
+}
+
+void NpzFile::write_local_header(const ZipLocalFileHeader& local_header, const string& name,
+                                 const string& extra_field)
+{
+    string buf = local_header_record(local_header, name, extra_field);
+    write_bytes(buf.data(), buf.size());
+}
+
+void NpzFile::write_data_descriptor(const ZipLocalFileHeader& local_header)
+{
+    ZipDataDescriptor descriptor;
+    descriptor.crc32 = local_header.crc32;
+    descriptor.compressed_size = local_header.compressed_size;
+    descriptor.uncompressed_size = local_header.uncompressed_size;
+    write_bytes(&descriptor, sizeof(descriptor));
+}
+
+void NpzFile::record_write_rate(size_t bytes, std::chrono::steady_clock::time_point start)
+{
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (seconds > 0) {
+        double rate = bytes / seconds;
+        std::lock_guard lock(policy_mutex_);
+        write_rate_ = write_rate_ > 0 ? 0.8 * write_rate_ + 0.2 * rate : rate;
+    }
+}
+
+void NpzFile::write_bytes(const void* data, size_t size)
+{
+    const char* p = static_cast<const char*>(data);
+    if (!streaming_) {
+        // Positioned, the file offset is meaningless with other threads' pwrites
+        write_at(offset_, p, size);
+        offset_ += size;
+        size = 0;
+    }
+    while (size > 0) {
+        ssize_t n = ::write(fd_, p, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            throw std::runtime_error("Failed to write to: " + filename_);
+        }
+        p += n;
+        size -= n;
+        offset_ += n;
     }
+    if (offset_ > UINT32_MAX) {
+        throw std::runtime_error("Archive exceeds 4 GiB (no ZIP64 support): " + filename_);
+    }
+}
 
-    // Add to central directory
+void NpzFile::copy_bytes_from(int fd, uint64_t in_offset, uint64_t out_offset, size_t size)
+{
+    // In kernel copy (reflinks on some filesystems) when both sides are files
+    loff_t in = in_offset, out = out_offset;
+    while (size > 0) {
+        ssize_t n = ::copy_file_range(fd, &in, fd_, streaming_ ? nullptr : &out, size, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;  // Not supported here, e.g. pipes or across filesystems on older kernels
+        size -= n;
+        if (streaming_) offset_ += n;
+    }
+    std::vector<char> buf(std::min<size_t>(size, 1 << 20));
+    while (size > 0) {
+        size_t n = std::min(size, buf.size());
+        read_at(fd, in, buf.data(), n, "copy source");
+        if (streaming_) {
+            write_bytes(buf.data(), n);
+        } else {
+            write_at(out, buf.data(), n);
+            out += n;
+        }
+        in += n;
+        size -= n;
+    }
+    if (streaming_ && offset_ > UINT32_MAX) {
+        throw std::runtime_error("Archive exceeds 4 GiB (no ZIP64 support): " + filename_);
+    }
+}
+
+void NpzFile::write_at(uint64_t offset, const void* data, size_t size)
+{
+    if (streaming_) {
+        throw std::logic_error("Streaming archives can't seek");
+    }
+    const char* p = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t n = ::pwrite(fd_, p, size, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            throw std::runtime_error("Failed to write to: " + filename_);
+        }
+        p += n;
+        size -= n;
+        offset += n;
+    }
+}
+
+void NpzFile::check_entry_count() const
+{
+    if (num_entries_ == UINT16_MAX) {
+        throw std::runtime_error("Archive exceeds 65535 entries (no ZIP64 support): " + filename_);
+    }
+}
+
+void NpzFile::add_to_central_directory(const ZipLocalFileHeader& local_header, std::string_view name,
+                                       std::string_view extra_field, uint32_t local_header_offset)
+{
+    check_entry_count();
+    num_entries_++;
+    size_t record_size = 6 + sizeof(local_header) + sizeof(ZipCentralDirectoryFileHeaderSuffix) + name.size() +
+                         extra_field.size();
+    if (central_dir_.capacity() - central_dir_.size() < record_size) {
+        central_dir_.reserve(std::max(2 * central_dir_.capacity(), CENTRAL_DIRECTORY_RESERVE + record_size));
+    }
     write4(central_dir_, ZIP_CENTRAL_DIRECTORY_FILE_HEADER_SIG);
     write2(central_dir_, VERSION_MADE_BY);
-    central_dir_.write(reinterpret_cast<const char*>(&local_header), sizeof(local_header));
+    central_dir_.append(reinterpret_cast<const char*>(&local_header), sizeof(local_header));
     ZipCentralDirectoryFileHeaderSuffix suffix;
     // TOCONSIDER: suffix.external_file_attr = 0640 << 16 for example (high 16 bits are OS permissions)
     suffix.relative_offset_of_local_header = local_header_offset;
-    central_dir_.write(reinterpret_cast<const char*>(&suffix), sizeof(ZipCentralDirectoryFileHeaderSuffix));
-    central_dir_.write(name.c_str(), filename_length);
+    central_dir_.append(reinterpret_cast<const char*>(&suffix), sizeof(ZipCentralDirectoryFileHeaderSuffix));
+    central_dir_ += name;
+    central_dir_ += extra_field;
+}
 
-    return local_header.compressed_size;
+size_t NpzFile::add_file_from_buffers(const string& name,
+                                    const char* buf0, size_t size0,
+                                    const char* buf1, size_t size1,
+                                    time_t timestamp, CompressionMethod compression,
+                                    const string& extra_field)
+{
+    if (streaming_ && compression == CompressionMethod::DEFLATE) {
+        return write_entry_streamed(name, buf0, size0, buf1, size1, timestamp, extra_field);
+    }
+    if (compression == CompressionMethod::DEFLATE && num_threads_ > 1 &&
+        (buf1 ? size1 : size0) >= 2 * SPLIT_BLOCK_SIZE) {
+        return write_entries_parallel(1, [&](size_t) {
+            return EntrySource{name, buf0, size0, buf1, size1, timestamp, compression, extra_field, {}};
+        });
+    }
+    return write_source(EntrySource{name, buf0, size0, buf1, size1, timestamp, compression, extra_field, {}});
+}
+
+bool NpzFile::reserve_deflate(size_t size, MemoryReservation& reservation)
+{
+    size_t bytes = compressBound(size) + DEFLATE_STATE_SIZE;
+    if (!memory_budget_->try_acquire(bytes)) return false;
+    reservation = MemoryReservation(*memory_budget_, bytes);
+    return true;
+}
+
+size_t NpzFile::write_source(EntrySource&& source)
+{
+    MemoryReservation reservation;
+    if (source.compression == CompressionMethod::DEFLATE &&
+        !reserve_deflate(source.size0 + (source.buf1 ? source.size1 : 0), reservation)) {
+        return write_entry_streamed(source.name, source.buf0, source.size0, source.buf1, source.size1,
+                                    source.timestamp, source.extra_field);
+    }
+    PreparedEntry entry = prepare_entry(std::move(source));
+    reservation.shrink(entry.compressed.size());
+    entry.reservation = std::move(reservation);
+    return write_entry(entry);
 }
 
-size_t NpzFile::add_array_of_type(const std::string& name, const std::string& type_descr, size_t type_size,
-                                  const char* data, const shape_type& shape, time_t timestamp)
+size_t NpzFile::write_entries_parallel(size_t count, const std::function<EntrySource(size_t)>& source)
 {
-    std::string npy_header = create_npy_header(type_descr, shape);
+    size_t written = 0;
+    if (num_threads_ <= 1) {
+        for (size_t i = 0; i < count; ++i) written += write_source(source(i));
+        return written;
+    }
+
+    // Workers take ranges of entries holding about SPLIT_BLOCK_SIZE bytes, so small entries are batched.
+    // Large DEFLATE entries are split in blocks, tasks that idle workers steal. This thread writes the
+    // entries in order, ranges are handed out up to a window ahead of it.
+    // Tasks run on the caller's executor or a pool of our own. Executors may run tasks inline, so none is
+    // handed over with mutex held
+    // Entries that don't fit in the memory budget are deferred to this thread, which compresses them
+    // straight to the output
+    struct Slot {
+        std::optional<PreparedEntry> entry;  // Ready to be written
+        std::optional<EntrySource> deferred;
+        // Split entries while their blocks are compressed
+        EntrySource source;
+        MemoryReservation reservation;
+        std::vector<std::vector<unsigned char>> blocks;
+        std::vector<uint32_t> block_crcs;
+        size_t blocks_left{0};
+    };
+    std::vector<Slot> slots(count);
+    std::mutex mutex;
+    std::condition_variable cv;
+    size_t next_source = 0, next_write = 0, ranges_in_flight = 0, tasks_in_flight = 0;
+    bool refilling = false, refill_again = false;
+    size_t sources_done = 0, source_bytes = 0;  // Sizes seen so far, for the range length
+    std::exception_ptr error;
+    std::atomic<bool> failed{false};
+
+    auto fail = [&](std::exception_ptr e) {
+        std::lock_guard lock(mutex);
+        if (!error) error = e;
+        failed = true;
+        cv.notify_all();
+    };
+    auto publish = [&](size_t i, PreparedEntry&& entry) {
+        std::lock_guard lock(mutex);
+        slots[i].entry = std::move(entry);
+        cv.notify_all();
+    };
+    // Data of split entries is buf1 after the .npy header in buf0, or buf0 alone
+    auto split_data = [](const EntrySource& s) {
+        return s.buf1 ? std::pair(s.buf1, s.size1) : std::pair(s.buf0, s.size0);
+    };
+
+    auto run_block = [&](size_t i, size_t k) {
+        if (failed) return;
+        Slot& slot = slots[i];
+        const EntrySource& s = slot.source;
+        try {
+            auto [data, size] = split_data(s);
+            size_t begin = k * SPLIT_BLOCK_SIZE;
+            size_t block_size = std::min(SPLIT_BLOCK_SIZE, size - begin);
+            const char* head = k == 0 && s.buf1 ? s.buf0 : nullptr;
+            size_t head_size = head ? s.size0 : 0;
+            size_t dictionary_size = std::min<size_t>(begin, 32768);  // The deflate window
+            bool last = k + 1 == slot.blocks.size();
+            slot.blocks[k] = deflate_block(head, head_size, data + begin, block_size,
+                                           data + begin - dictionary_size, dictionary_size, last);
+            uint32_t crc = crc32(0u, reinterpret_cast<const Bytef*>(head), head_size);
+            slot.block_crcs[k] = crc32(crc, reinterpret_cast<const Bytef*>(data + begin), block_size);
+            {
+                std::lock_guard lock(mutex);
+                if (--slot.blocks_left > 0) return;
+            }
+
+            // Last block done: blocks concatenate into one deflate stream, CRCs combine
+            PreparedEntry entry = start_entry(s.name, s.timestamp, s.extra_field, s.size0 + (s.buf1 ? s.size1 : 0));
+            ZipLocalFileHeader& local_header = entry.local_header;
+            local_header.compression_method = static_cast<uint16_t>(CompressionMethod::DEFLATE);
+            uint32_t entry_crc = slot.block_crcs[0];
+            size_t compressed_size = slot.blocks[0].size();
+            for (size_t b = 1; b < slot.blocks.size(); ++b) {
+                size_t length = std::min(SPLIT_BLOCK_SIZE, size - b * SPLIT_BLOCK_SIZE);
+                entry_crc = crc32_combine(entry_crc, slot.block_crcs[b], length);
+                compressed_size += slot.blocks[b].size();
+            }
+            local_header.crc32 = entry_crc;
+            entry.compressed.reserve(compressed_size);
+            for (auto& block : slot.blocks) {
+                entry.compressed.insert(entry.compressed.end(), block.begin(), block.end());
+                std::vector<unsigned char>().swap(block);
+            }
+            local_header.compressed_size = entry.compressed.size();
+            entry.reservation = std::move(slot.reservation);
+            entry.reservation.shrink(entry.compressed.size());
+            slot.source = EntrySource{};
+            publish(i, std::move(entry));
+        } catch (...) {
+            fail(std::current_exception());
+        }
+    };
+
+    Executor& executor = executor_ ? *executor_ : own_pool();
+    auto execute = [&](std::function<void()> task) {
+        {
+            std::lock_guard lock(mutex);
+            ++tasks_in_flight;
+        }
+        auto counted = [&, task = std::move(task)]() {
+            task();
+            std::lock_guard lock(mutex);  // Held while notifying, cv may go away right after
+            --tasks_in_flight;
+            cv.notify_all();
+        };
+        try {
+            executor.execute(counted);
+        } catch (...) {
+            fail(std::current_exception());
+            std::lock_guard lock(mutex);
+            --tasks_in_flight;
+        }
+    };
+    std::function<void()> refill;
+    auto run_range = [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end && !failed; ++i) {
+            try {
+                EntrySource s = source(i);
+                auto [data, size] = split_data(s);
+                {
+                    std::lock_guard lock(mutex);
+                    ++sources_done;
+                    source_bytes += s.size0 + (s.buf1 ? s.size1 : 0);
+                }
+                if (s.compression != CompressionMethod::DEFLATE) {
+                    publish(i, prepare_entry(std::move(s)));
+                    continue;
+                }
+                MemoryReservation reservation;
+                if (!reserve_deflate(s.size0 + (s.buf1 ? s.size1 : 0), reservation)) {
+                    std::lock_guard lock(mutex);
+                    slots[i].deferred = std::move(s);
+                    cv.notify_all();
+                    continue;
+                }
+                if (size < 2 * SPLIT_BLOCK_SIZE) {
+                    PreparedEntry entry = prepare_entry(std::move(s));
+                    reservation.shrink(entry.compressed.size());
+                    entry.reservation = std::move(reservation);
+                    publish(i, std::move(entry));
+                    continue;
+                }
+                // Other blocks go to this worker's deque, it takes the nearest ones, idle workers the others
+                Slot& slot = slots[i];
+                size_t num_blocks = (size + SPLIT_BLOCK_SIZE - 1) / SPLIT_BLOCK_SIZE;
+                slot.source = std::move(s);
+                slot.reservation = std::move(reservation);
+                slot.blocks.resize(num_blocks);
+                slot.block_crcs.resize(num_blocks);
+                slot.blocks_left = num_blocks;
+                for (size_t k = num_blocks; k-- > 1;) {
+                    execute([&run_block, i, k]() { run_block(i, k); });
+                }
+                run_block(i, 0);
+            } catch (...) {
+                fail(std::current_exception());
+            }
+        }
+        {
+            std::lock_guard lock(mutex);
+            --ranges_in_flight;
+        }
+        refill();
+    };
+    // Hands out ranges while the window allows. A nested call, from a task run inline, leaves it to the outer one
+    refill = [&]() {
+        std::unique_lock lock(mutex);
+        if (refilling) {
+            refill_again = true;
+            return;
+        }
+        refilling = true;
+        do {
+            refill_again = false;
+            std::vector<std::pair<size_t, size_t>> ranges;
+            while (!error && ranges_in_flight < num_threads_ && next_source < count) {
+                size_t length = 1;
+                if (sources_done > 0) {
+                    size_t average_size = std::max<size_t>(source_bytes / sources_done, 1);
+                    length = std::clamp<size_t>(SPLIT_BLOCK_SIZE / average_size, 1, MAX_BATCH_ENTRIES);
+                }
+                if (next_source >= next_write + 2 * num_threads_ * length) break;
+                ranges.emplace_back(next_source, std::min(count, next_source + length));
+                next_source = ranges.back().second;
+                ++ranges_in_flight;
+            }
+            lock.unlock();
+            for (auto [begin, end] : ranges) {
+                execute([&run_range, begin, end]() { run_range(begin, end); });
+            }
+            lock.lock();
+        } while (refill_again);
+        refilling = false;
+    };
+
+    try {
+        refill();
+        std::unique_lock lock(mutex);
+        while (next_write < count) {
+            Slot& slot = slots[next_write];
+            cv.wait(lock, [&]() { return error || slot.entry || slot.deferred; });
+            if (error) break;
+            lock.unlock();
+            if (slot.entry) {
+                written += write_entry(*slot.entry);
+                slot.entry.reset();
+            } else {
+                EntrySource& s = *slot.deferred;
+                written += write_entry_streamed(s.name, s.buf0, s.size0, s.buf1, s.size1, s.timestamp,
+                                                s.extra_field);
+                slot.deferred.reset();
+            }
+            lock.lock();
+            ++next_write;
+            lock.unlock();
+            refill();
+            lock.lock();
+        }
+    } catch (...) {
+        fail(std::current_exception());
+    }
+    {
+        // Tasks still running see the error and stop early
+        std::unique_lock lock(mutex);
+        cv.wait(lock, [&]() { return tasks_in_flight == 0; });
+    }
+    if (error) std::rethrow_exception(error);
+    return written;
+}
+
+size_t NpzFile::add_array_of_type(const std::string& name, std::string_view type_descr, size_t type_size,
+                                  const char* data, const shape_type& shape, time_t timestamp,
+                                  CompressionMethod compression, const filter_list& filters)
+{
+    std::shared_ptr<const std::string> cached_header = cached_npy_header(type_descr, shape);
+    const std::string& npy_header = *cached_header;
     string full_name = filename_with_extension(name, ".npy");
-    size_t data_size = std::accumulate(shape.begin(), shape.end(), 1, std::multiplies<size_t>()) * type_size;
-    return add_file_from_buffers(full_name, npy_header.c_str(), npy_header.size(), data, data_size, timestamp);
+    size_t data_size = std::accumulate(shape.begin(), shape.end(), size_t(1), std::multiplies<size_t>()) * type_size;
+    if (type_size > 0xff || filters.size() > 0xff) {
+        throw std::runtime_error("Unsupported filter pipeline for: " + name);
+    }
+    string extra;
+    if (fingerprint_) {
+        uint64_t digest = entry_digest(npy_header, data, data_size, compression,
+                                       {reinterpret_cast<const char*>(filters.data()), filters.size()});
+        const ZipEntry* base_entry = checkpoint_base_ ? checkpoint_base_->find(full_name) : nullptr;
+        if (base_entry) {
+            std::string_view base_digest = find_extra_field(base_entry->extra_field, CNPZ_DIGEST_EXTRA_ID);
+            if (base_digest.size() == sizeof(digest) && std::memcmp(base_digest.data(), &digest, sizeof(digest)) == 0) {
+                ++reused_entries_;
+                return copy_entry_from(*checkpoint_base_, full_name);
+            }
+        }
+        write2(extra, CNPZ_DIGEST_EXTRA_ID);
+        write2(extra, sizeof(digest));
+        extra.append(reinterpret_cast<const char*>(&digest), sizeof(digest));
+    }
+    if (filters.empty()) {
+        return add_file_from_buffers(full_name, npy_header.c_str(), npy_header.size(), data, data_size, timestamp,
+                                     compression, extra);
+    }
+
+    std::vector<char> filtered(data_size), scratch;
+    apply_filter(filters[0], data, filtered.data(), data_size, type_size);
+    for (size_t i = 1; i < filters.size(); ++i) {
+        scratch.resize(data_size);
+        apply_filter(filters[i], filtered.data(), scratch.data(), data_size, type_size);
+        filtered.swap(scratch);
+    }
+    write2(extra, CNPZ_FILTER_EXTRA_ID);
+    write2(extra, 2 + filters.size());
+    extra += static_cast<char>(type_size);
+    extra += static_cast<char>(filters.size());
+    for (Filter filter : filters) extra += static_cast<char>(filter);
+    return add_file_from_buffers(full_name, npy_header.c_str(), npy_header.size(), filtered.data(), data_size,
+                                 timestamp, compression, extra);
 }
 
-std::string NpzFile::create_npy_header(const string& type_descr, const shape_type& shape)
+void NpzFile::set_checkpoint_base(const string& base_filename)
 {
-    assert(shape.size() > 0);
+    fingerprint_ = true;
+    checkpoint_base_.reset();
+    if (std::filesystem::exists(base_filename)) {
+        checkpoint_base_ = std::make_unique<NpzReader>(base_filename);
+    }
+}
 
-    NpyHeader npy_header;
-    npy_header.header_len = NPY_ARRAY_ALIGN - sizeof(NpyHeader);
-    std::string header;
-    header.reserve(128); // Usually be of size 64
-    header.append(reinterpret_cast<const char*>(&npy_header), sizeof(npy_header));
-    header += "{'descr': '";
-    header += type_descr;
-    header += "', 'fortran_order': False, 'shape': (";
-    header += std::to_string(shape[0]);
-    for (size_t i = 1; i < shape.size(); ++i) {
-        header += ",";
-        header += std::to_string(shape[i]);
-    }
-    if (shape.size() == 1) header += ",";  // Python tuple
-    header += ")}";
-    //pad with spaces so that preamble+dict is modulo 16 bytes. preamble is 10 bytes. dict needs to end with \n
-    int pad_count = NPY_ARRAY_ALIGN - (header.size() + 1) % NPY_ARRAY_ALIGN;  // 1 more for newline
-    header.append(pad_count, ' ');
-    header.append("\n");
-    assert(header.size() <= 0xffff); // Would need to switch to NPY 2.0 otherwise
-    if (header.size() > NPY_ARRAY_ALIGN) {
-        npy_header.header_len = header.size() - sizeof(NpyHeader);
-        header.replace(8, 2, reinterpret_cast<const char*>(&npy_header.header_len), 2);
-    }
-    assert(header.size() % NPY_ARRAY_ALIGN == 0);
+size_t NpzFile::add_arrays_of_type(const std::vector<ArraySpec>& arrays, time_t timestamp,
+                                   CompressionMethod compression)
+{
+    std::vector<string> names;
+    std::vector<std::shared_ptr<const std::string>> headers;
+    for (const ArraySpec& array : arrays) {
+        names.push_back(filename_with_extension(array.name, ".npy"));
+        headers.push_back(cached_npy_header(array.type_descr, array.shape));
+    }
+    if (timestamp == 0) {
+        timestamp = std::time(nullptr);
+    }
+    return write_entries_parallel(arrays.size(), [&](size_t i) {
+        const ArraySpec& array = arrays[i];
+        size_t data_size = std::accumulate(array.shape.begin(), array.shape.end(), size_t(1),
+                                           std::multiplies<size_t>()) * array.type_size;
+        return EntrySource{names[i], headers[i]->data(), headers[i]->size(), array.data, data_size,
+                           timestamp, compression, "", {}};
+    });
+}
+
+size_t NpzFile::add_sparse_of_type(SparseFormat format, size_t rows, size_t cols,
+                                   std::string_view type_descr, size_t type_size, const char* data, size_t nnz,
+                                   const std::vector<ArraySpec>& index_arrays, CompressionMethod compression)
+{
+    // Entry set of scipy.sparse.save_npz
+    static const char* format_names[] = {"csr", "csc", "coo"};
+    const char* format_name = format_names[static_cast<int>(format)];
+    int64_t shape[2] = {static_cast<int64_t>(rows), static_cast<int64_t>(cols)};
+    std::vector<ArraySpec> arrays = index_arrays;
+    arrays.push_back({"format", "|S3", 3, format_name, {}});
+    arrays.push_back({"shape", numpy_descr<int64_t>(), sizeof(int64_t), reinterpret_cast<const char*>(shape), {2}});
+    arrays.push_back({"data", type_descr, type_size, data, {nnz}});
+    return add_arrays_of_type(arrays, 0, compression);
+}
+
+// Copies the chunk at origin into out (already zeroed), clipping at the array edges
+void copy_chunk(const char* data, char* out, const shape_type& shape, const shape_type& chunks,
+                const shape_type& origin, size_t type_size, size_t dim = 0)
+{
+    size_t src_stride = type_size, dst_stride = type_size;
+    for (size_t d = dim + 1; d < shape.size(); ++d) {
+        src_stride *= shape[d];
+        dst_stride *= chunks[d];
+    }
+    size_t extent = std::min(chunks[dim], shape[dim] - origin[dim]);
+    data += origin[dim] * src_stride;
+    if (dim + 1 == shape.size()) {
+        std::memcpy(out, data, extent * type_size);
+        return;
+    }
+    for (size_t j = 0; j < extent; ++j) {
+        copy_chunk(data + j * src_stride, out + j * dst_stride, shape, chunks, origin, type_size, dim + 1);
+    }
+}
+
+string json_list(const shape_type& values)
+{
+    string list = "[";
+    for (size_t i = 0; i < values.size(); ++i) {
+        if (i > 0) list += ", ";
+        append_decimal(list, values[i]);
+    }
+    list += "]";
+    return list;
+}
+
+size_t NpzFile::add_chunked_array_of_type(const string& name, std::string_view type_descr, size_t type_size,
+                                          const char* data, const shape_type& shape, const shape_type& chunks,
+                                          time_t timestamp, CompressionMethod compression)
+{
+    if (shape.empty() || chunks.size() != shape.size() ||
+        std::find(chunks.begin(), chunks.end(), 0) != chunks.end()) {
+        throw std::invalid_argument("Chunks must be non-zero and match the shape rank: " + name);
+    }
+    bool write_group;
+    {
+        std::lock_guard lock(write_mutex_);
+        write_group = !std::exchange(wrote_zarr_group_, true);
+    }
+    if (write_group) {
+        add_file(".zgroup", string("{\n    \"zarr_format\": 2\n}\n"), timestamp);
+    }
+    // Chunks are stored as raw C-order data, the ZIP entry does the compression
+    char kind = type_descr.size() > 1 ? type_descr[1] : ' ';
+    bool numeric = kind == 'i' || kind == 'u' || kind == 'f' || kind == 'b';
+    string zarray = "{\n"
+        "    \"chunks\": " + json_list(chunks) + ",\n"
+        "    \"compressor\": null,\n"
+        "    \"dtype\": \"" + string(type_descr) + "\",\n"
+        "    \"fill_value\": " + (numeric ? "0" : "null") + ",\n"
+        "    \"filters\": null,\n"
+        "    \"order\": \"C\",\n"
+        "    \"shape\": " + json_list(shape) + ",\n"
+        "    \"zarr_format\": 2\n"
+        "}\n";
+    add_file(name + "/.zarray", zarray, timestamp);
+
+    shape_type grid(shape.size());
+    size_t num_chunks = 1, chunk_size = type_size;
+    for (size_t d = 0; d < shape.size(); ++d) {
+        grid[d] = (shape[d] + chunks[d] - 1) / chunks[d];
+        num_chunks *= grid[d];
+        chunk_size *= chunks[d];
+    }
+    if (timestamp == 0) {
+        timestamp = std::time(nullptr);  // Same for all chunks
+    }
+
+    return write_entries_parallel(num_chunks, [&](size_t index) {
+        // Chunk keys are the chunk grid indices in C order
+        shape_type origin(shape.size());
+        for (size_t d = shape.size(), rest = index; d-- > 0;) {
+            origin[d] = rest % grid[d] * chunks[d];
+            rest /= grid[d];
+        }
+        string key;
+        key.reserve(name.size() + 1 + 8 * shape.size());
+        key += name;
+        key += '/';
+        for (size_t d = 0; d < shape.size(); ++d) {
+            if (d > 0) key += '.';
+            append_decimal(key, origin[d] / chunks[d]);
+        }
+        std::vector<char> chunk(chunk_size, 0);
+        copy_chunk(data, chunk.data(), shape, chunks, origin, type_size);
+        const char* chunk_data = chunk.data();
+        return EntrySource{std::move(key), chunk_data, chunk_size, nullptr, 0, timestamp, compression, "",
+                           std::move(chunk)};
+    });
+}
+
+std::string NpzFile::create_npy_header(std::string_view type_descr, std::span<const size_t> shape, size_t min_size)
+{
+    // Fixed text, up to 20 digits and a comma per dimension, and the padding
+    std::string header(std::max(min_size, 128 + type_descr.size() + 21 * shape.size()) + NPY_ARRAY_ALIGN, '\0');
+    header.resize(format_npy_header(header.data(), header.size(), type_descr, shape, min_size));
     return header;
 }
+
+std::shared_ptr<const std::string> NpzFile::cached_npy_header(std::string_view type_descr, const shape_type& shape)
+{
+    {
+        std::lock_guard lock(header_cache_mutex_);
+        for (const CachedNpyHeader& cached : header_cache_) {
+            if (cached.type_descr == type_descr && cached.shape == shape) {
+                ++header_cache_hits_;
+                return cached.header;
+            }
+        }
+    }
+    ++header_cache_misses_;
+    auto header = std::make_shared<const std::string>(create_npy_header(type_descr, shape));
+    std::lock_guard lock(header_cache_mutex_);
+    CachedNpyHeader entry{string(type_descr), shape, header};
+    if (header_cache_.size() < NPY_HEADER_CACHE_SIZE) {
+        header_cache_.push_back(std::move(entry));
+    } else {
+        header_cache_[header_cache_next_] = std::move(entry);
+        header_cache_next_ = (header_cache_next_ + 1) % NPY_HEADER_CACHE_SIZE;
+    }
+    return header;
+}
+
+size_t NpzFile::format_npy_header(char* out, size_t capacity, std::string_view type_descr,
+                                  std::span<const size_t> shape, size_t min_size)
+{
+    char* p = out;
+    char* end = out + capacity;
+    auto put = [&](std::string_view text) {
+        if (text.size() > size_t(end - p)) return false;
+        std::memcpy(p, text.data(), text.size());
+        p += text.size();
+        return true;
+    };
+    // Written after the 1.0 preamble, moved on if it needs the longer one
+    NpyHeader npy_header;
+    bool quoted = !type_descr.starts_with('[');  // Structured descrs are lists
+    bool fits = put({reinterpret_cast<const char*>(&npy_header), sizeof(npy_header)}) &&
+                put(quoted ? "{'descr': '" : "{'descr': ") && put(type_descr) &&
+                put(quoted ? "', 'fortran_order': False, 'shape': (" : ", 'fortran_order': False, 'shape': (");
+    for (size_t i = 0; fits && i < shape.size(); ++i) {  // Empty for 0-d arrays
+        if (i > 0) fits = put(",");
+        auto [digits_end, ec] = std::to_chars(p, end, shape[i]);
+        fits = fits && ec == std::errc{};
+        if (fits) p = digits_end;
+    }
+    if (fits && shape.size() == 1) fits = put(",");  // Python tuple
+    fits = fits && put(")}");
+    if (!fits) return 0;
+    size_t dict_size = p - out - NPY_PREAMBLE_SIZE_V1;
+    // Padded with spaces so that the data is aligned, the dict ends with a newline
+    auto padded_size = [&](size_t preamble_size) {
+        size_t size = (preamble_size + dict_size + 1 + NPY_ARRAY_ALIGN - 1) / NPY_ARRAY_ALIGN * NPY_ARRAY_ALIGN;
+        return std::max(size, min_size);
+    };
+    // 1.0 has a 16-bit header length and ASCII only, 2.0 widens the length and 3.0 allows UTF-8
+    bool utf8 = std::any_of(type_descr.begin(), type_descr.end(), [](char c) { return c & 0x80; });
+    size_t preamble_size = NPY_PREAMBLE_SIZE_V1;
+    size_t size = padded_size(preamble_size);
+    if (utf8 || size - preamble_size > 0xffff) {
+        preamble_size = NPY_PREAMBLE_SIZE_V2;
+        size = padded_size(preamble_size);
+        if (size > capacity) return 0;
+        std::memmove(out + preamble_size, out + NPY_PREAMBLE_SIZE_V1, dict_size);
+    }
+    if (size > capacity) return 0;
+    char* dict_end = out + preamble_size + dict_size;
+    std::memset(dict_end, ' ', out + size - 1 - dict_end);
+    out[size - 1] = '\n';
+    if (preamble_size == NPY_PREAMBLE_SIZE_V1) {
+        uint16_t header_len = size - preamble_size;
+        std::memcpy(out + 8, &header_len, 2);
+    } else {
+        out[6] = utf8 ? 3 : 2;
+        uint32_t header_len = size - preamble_size;
+        std::memcpy(out + 8, &header_len, 4);
+    }
+    assert(size % NPY_ARRAY_ALIGN == 0);
+    return size;
+}
+
+size_t NpzFile::copy_entry_from(const NpzReader& source, const string& name)
+{
+    const ZipEntry& entry = source.entry(name);
+    // Header fields come from the source local header, CRC and sizes from its central directory, which
+    // has them even when a data descriptor follows the data
+    ZipLocalFileHeader local_header;
+    char buf[4 + sizeof(local_header)];
+    read_at(source.fd_, entry.local_header_offset, buf, sizeof(buf), source.filename());
+    std::memcpy(&local_header, buf + 4, sizeof(local_header));
+    uint64_t data_offset = uint64_t(entry.local_header_offset) + sizeof(buf) +
+                           local_header.filename_length + local_header.extra_field_length;
+    local_header.general_purpose_bit_flag &= ~ZIP_FLAG_DATA_DESCRIPTOR;
+    local_header.crc32 = entry.crc32;
+    local_header.compressed_size = entry.compressed_size;
+    local_header.uncompressed_size = entry.uncompressed_size;
+    local_header.filename_length = entry.name.size();
+    local_header.extra_field_length = entry.extra_field.size();
+    auto begin_copy = [&]() {
+        if (open_appender_) {
+            throw std::runtime_error("Can't add " + name + " while an appendable array is open");
+        }
+        check_entry_count();
+        if (name == ".zgroup") {
+            // One root group is enough
+            if (wrote_zarr_group_) return false;
+            wrote_zarr_group_ = true;
+        }
+        return true;
+    };
+
+    if (streaming_) {
+        std::lock_guard lock(write_mutex_);
+        if (!begin_copy()) return 0;
+        uint32_t local_header_offset = offset_;
+        write_local_header(local_header, entry.name, entry.extra_field);
+        copy_bytes_from(source.fd_, data_offset, offset_, entry.compressed_size);
+        add_to_central_directory(local_header, entry.name, entry.extra_field, local_header_offset);
+        return entry.compressed_size;
+    }
+
+    // Same as write_entry: the range is reserved under the lock and copied outside it
+    string header = local_header_record(local_header, entry.name, entry.extra_field);
+    uint64_t offset;
+    {
+        std::lock_guard lock(write_mutex_);
+        if (!begin_copy()) return 0;
+        if (offset_ + header.size() + entry.compressed_size > UINT32_MAX) {
+            throw std::runtime_error("Archive exceeds 4 GiB (no ZIP64 support): " + filename_);
+        }
+        offset = offset_;
+        offset_ += header.size() + entry.compressed_size;
+        add_to_central_directory(local_header, entry.name, entry.extra_field, offset);
+        ++writes_in_flight_;
+    }
+    try {
+        write_at(offset, header.data(), header.size());
+        copy_bytes_from(source.fd_, data_offset, offset + header.size(), entry.compressed_size);
+    } catch (...) {
+        end_write(std::current_exception());
+        throw;
+    }
+    end_write(nullptr);
+    return entry.compressed_size;
+}
+
+size_t NpzFile::merge_from(const NpzReader& source)
+{
+    size_t copied = 0;
+    for (const ZipEntry& entry : source.entries()) {
+        copied += copy_entry_from(source, entry.name);
+    }
+    return copied;
+}
+
+// ArrayAppender
+ArrayAppender NpzFile::begin_array_of_type(const string& name, std::string_view type_descr, size_t type_size,
+                                           const shape_type& row_shape, time_t timestamp)
+{
+    std::lock_guard lock(write_mutex_);
+    if (open_appender_) {
+        throw std::runtime_error("Can't add " + name + " while an appendable array is open");
+    }
+    check_entry_count();
+    if (streaming_) {
+        throw std::runtime_error("Appendable arrays need a seekable archive: " + name);
+    }
+    ArrayAppender appender;
+    appender.npz_ = this;
+    appender.name_ = filename_with_extension(name, ".npy");
+    appender.type_descr_ = type_descr;
+    appender.type_size_ = type_size;
+    appender.row_shape_ = row_shape;
+    appender.row_size_ = std::accumulate(row_shape.begin(), row_shape.end(), type_size, std::multiplies<size_t>());
+    if (appender.name_.size() > 0xffff) {
+        throw std::runtime_error("Filename too long: " + appender.name_);
+    }
+
+    // Reserve room for the longest row count so the header can be patched in place
+    shape_type shape{SIZE_MAX};
+    shape.insert(shape.end(), row_shape.begin(), row_shape.end());
+    appender.header_size_ = create_npy_header(type_descr, shape).size();
+    shape[0] = 0;
+    string npy_header = create_npy_header(type_descr, shape, appender.header_size_);
+
+    // Sizes and CRC are patched on close, until then the entry is a valid empty array
+    appender.timestamp_ = timestamp ? timestamp : std::time(nullptr);
+    ZipLocalFileHeader local_header;
+    set_timestamp(local_header, appender.timestamp_);
+    local_header.filename_length = appender.name_.size();
+    local_header.crc32 = crc32(0u, reinterpret_cast<const Bytef*>(npy_header.data()), npy_header.size());
+    local_header.compressed_size = npy_header.size();
+    local_header.uncompressed_size = npy_header.size();
+    appender.local_header_offset_ = offset_;
+    write_local_header(local_header, appender.name_, "");
+    write_bytes(npy_header.data(), npy_header.size());
+    open_appender_ = &appender;  // Kept pointing at the appender by its move constructor, NRVO or not
+    return appender;
+}
+
+ArrayAppender::ArrayAppender(ArrayAppender&& other) noexcept
+:
+    npz_{std::exchange(other.npz_, nullptr)},
+    name_{std::move(other.name_)},
+    type_descr_{std::move(other.type_descr_)},
+    type_size_{other.type_size_},
+    row_shape_{std::move(other.row_shape_)},
+    row_size_{other.row_size_},
+    num_rows_{other.num_rows_},
+    data_crc_{other.data_crc_},
+    header_size_{other.header_size_},
+    timestamp_{other.timestamp_},
+    local_header_offset_{other.local_header_offset_}
+{
+    if (npz_) npz_->open_appender_ = this;
+}
+
+ArrayAppender::~ArrayAppender()
+{
+    try {
+        close();
+    } catch (...) {
+        // Call close() explicitly to see errors
+    }
+}
+
+void ArrayAppender::append_bytes(const char* data, size_t num_rows)
+{
+    if (!npz_) {
+        throw std::runtime_error("Appendable array is closed: " + name_);
+    }
+    size_t size = num_rows * row_size_;
+    if (header_size_ + (num_rows_ + num_rows) * row_size_ > UINT32_MAX) {
+        throw std::runtime_error("Appendable array exceeds 4 GiB: " + name_);
+    }
+    {
+        std::lock_guard lock(npz_->write_mutex_);
+        npz_->write_bytes(data, size);
+    }
+    data_crc_ = crc32(data_crc_, reinterpret_cast<const Bytef*>(data), size);
+    num_rows_ += num_rows;
+}
+
+void ArrayAppender::close()
+{
+    if (!npz_) return;
+    NpzFile& npz = *npz_;
+    std::lock_guard lock(npz.write_mutex_);
+    npz_ = nullptr;
+    npz.open_appender_ = nullptr;
+
+    shape_type shape{num_rows_};
+    shape.insert(shape.end(), row_shape_.begin(), row_shape_.end());
+    string npy_header = NpzFile::create_npy_header(type_descr_, shape, header_size_);
+    assert(npy_header.size() == header_size_);
+    size_t data_size = num_rows_ * row_size_;
+    ZipLocalFileHeader local_header;
+    set_timestamp(local_header, timestamp_);
+    local_header.filename_length = name_.size();
+    uint32_t crc = crc32(0u, reinterpret_cast<const Bytef*>(npy_header.data()), npy_header.size());
+    local_header.crc32 = crc32_combine(crc, data_crc_, data_size);
+    local_header.compressed_size = header_size_ + data_size;
+    local_header.uncompressed_size = header_size_ + data_size;
+
+    npz.write_at(local_header_offset_ + 4, &local_header, sizeof(local_header));
+    npz.write_at(local_header_offset_ + 4 + sizeof(local_header) + name_.size(), npy_header.data(), npy_header.size());
+
+    npz.add_to_central_directory(local_header, name_, "", local_header_offset_);
+}
@@ -1,11 +1,30 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <chrono>
+#include <climits>
+#include <cstddef>
 #include <cstdint>
+#include <cstring>
 #include <string>
 #include <fstream>
-#include <sstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string_view>
 #include <complex>
+#include <condition_variable>
+#include <exception>
+#include <atomic>
+#include <thread>
+#include <type_traits>
+#include <utility>
 #include <vector>
+#include "executor.h"
+#include "memory_budget.h"
 
 namespace cnpz {
     using shape_type = std::vector<size_t>;
@@ -15,47 +34,552 @@ namespace cnpz {
         DEFLATE = 8
     };
 
+    enum class OpenMode {
+        TRUNCATE,  // Start a new archive
+        APPEND,    // Add entries to an existing archive (or start a new one), keeping what is there
+    };
+
+    enum class SparseFormat {
+        CSR = 0,
+        CSC = 1,
+        COO = 2,
+    };
+
+    // Reversible transforms of the .npy data ahead of compression, recorded in a cnpz extra field.
+    // NpzReader undoes them on load, other readers see the filtered bytes
+    enum class Filter : uint8_t {
+        NONE = 0,
+        SHUFFLE = 1,      // Byte transpose by significance
+        BITSHUFFLE = 2,   // Bit transpose by significance
+        DELTA = 3,        // Difference with the previous element, for integer types
+        XOR = 4,          // XOR with the previous element, for floats (Gorilla style)
+    };
+    using filter_list = std::vector<Filter>;
+
+    // Settings for DEFLATE entries. With a target throughput or a deadline, the zlib level and strategy are
+    // adjusted block by block from the measured compression speed and output write rate.
+    struct CompressionPolicy {
+        int level{-1};                   // zlib level, -1 is Z_DEFAULT_COMPRESSION
+        int strategy{0};                 // zlib strategy, 0 is Z_DEFAULT_STRATEGY
+        double target_throughput{0};     // uncompressed bytes per second, 0 disables
+        std::chrono::steady_clock::time_point deadline{};  // for the whole archive, unset disables
+        size_t expected_total_bytes{0};  // uncompressed bytes still to come when using a deadline
+        size_t block_size{1 << 20};      // granularity of the feedback loop
+    };
+
+    // Structs registered with CNPZ_RECORD, stored as NumPy structured arrays
+    template<typename T>
+    struct RecordTraits {
+        static constexpr bool registered = false;
+    };
+    template<typename T> inline constexpr bool is_record_v = RecordTraits<T>::registered;
+
+    struct RecordField {
+        std::string_view name;
+        size_t offset;
+        size_t size;
+        std::string descr;  // What follows the name in a descr list item: "'<f4'", "'<f4', (3,)" or "[...]"
+    };
+    // List descr of a record of record_size bytes, padding included as ('', '|Vn') fields like NumPy has it
+    std::string make_record_descr(std::vector<RecordField> fields, size_t record_size);
+
     // Template-based mapping of C++ types to NumPy descriptors
-    template<typename T> std::string numpy_descr();
+    template<typename T> std::string_view numpy_descr() {
+        static_assert(is_record_v<T>, "No NumPy descriptor for this type, structs need CNPZ_RECORD");
+        static const std::string descr = make_record_descr(RecordTraits<T>::fields(), sizeof(T));
+        return descr;
+    }
+    template<> constexpr std::string_view numpy_descr<int8_t>() { return "|i1"; }
+    template<> constexpr std::string_view numpy_descr<int16_t>() { return "<i2"; }
+    template<> constexpr std::string_view numpy_descr<int32_t>() { return "<i4"; }
+    template<> constexpr std::string_view numpy_descr<int64_t>() { return "<i8"; }
+    template<> constexpr std::string_view numpy_descr<uint8_t>() { return "|u1"; }
+    template<> constexpr std::string_view numpy_descr<uint16_t>() { return "<u2"; }
+    template<> constexpr std::string_view numpy_descr<uint32_t>() { return "<u4"; }
+    template<> constexpr std::string_view numpy_descr<uint64_t>() { return "<u8"; }
+    template<> constexpr std::string_view numpy_descr<float>() { return "<f4"; }
+    template<> constexpr std::string_view numpy_descr<double>() { return "<f8"; }
+    template<> constexpr std::string_view numpy_descr<char>() { return "|S1"; }
+    template<> constexpr std::string_view numpy_descr<std::complex<float>>() { return "<c8"; }
+    template<> constexpr std::string_view numpy_descr<std::complex<double>>() { return "<c16"; }
+
+    template<typename M>
+    void append_extents(std::string& shape) {
+        if constexpr (std::is_array_v<M>) {
+            if (shape.size() > 1) shape += ", ";
+            shape += std::to_string(std::extent_v<M>);
+            append_extents<std::remove_extent_t<M>>(shape);
+        }
+    }
+    // Descr list item of a member of type M after its name
+    template<typename M>
+    std::string record_field_descr() {
+        if constexpr (std::is_array_v<M>) {
+            std::string shape = "(";
+            append_extents<M>(shape);
+            shape += std::rank_v<M> == 1 ? ",)" : ")";
+            return record_field_descr<std::remove_all_extents_t<M>>() + ", " + shape;
+        } else if constexpr (is_record_v<M>) {
+            return std::string(numpy_descr<M>());
+        } else {
+            return "'" + std::string(numpy_descr<M>()) + "'";
+        }
+    }
+
+    // NPY 1.0 header of T arrays of rank Rank laid out at compile time, padding included: format() copies it
+    // and only writes the shape digits, the closing brace, the newline and the header length
+    template<typename T, size_t Rank>
+    class NpyHeaderFormat {
+        static constexpr std::string_view dict_start = "{'descr': '";
+        static constexpr std::string_view dict_shape = "', 'fortran_order': False, 'shape': (";
+        static constexpr size_t align = 64;
+        static constexpr size_t prefix_size = 10 + dict_start.size() + numpy_descr<T>().size() + dict_shape.size();
+    public:
+        // Up to 20 digits and a comma per dimension, ",)}" and the newline
+        static constexpr size_t capacity = (prefix_size + 21 * Rank + 4 + align - 1) / align * align;
 
+        // out has room for capacity bytes, returns the header size
+        static size_t format(char* out, std::span<const size_t> shape) {
+            std::memcpy(out, layout.data(), capacity);
+            char* p = out + prefix_size;
+            for (size_t i = 0; i < Rank; ++i) {
+                if (i > 0) *p++ = ',';
+                p = std::to_chars(p, out + capacity, shape[i]).ptr;
+            }
+            if constexpr (Rank == 1) *p++ = ',';  // Python tuple
+            *p++ = ')';
+            *p++ = '}';
+            size_t size = (p - out + 1 + align - 1) / align * align;
+            out[size - 1] = '\n';
+            uint16_t header_len = size - 10;
+            std::memcpy(out + 8, &header_len, 2);
+            return size;
+        }
+    private:
+        static constexpr std::array<char, capacity> layout = []() {
+            std::array<char, capacity> layout{};
+            std::string_view magic = "\x93NUMPY\x01";
+            size_t pos = 0;
+            for (char c : magic) layout[pos++] = c;
+            layout[pos++] = 0;  // Version 1.0
+            pos += 2;  // Header length
+            for (std::string_view part : {dict_start, numpy_descr<T>(), dict_shape}) {
+                for (char c : part) layout[pos++] = c;
+            }
+            while (pos < capacity) layout[pos++] = ' ';
+            return layout;
+        }();
+    };
+
+    // Registers a standard-layout struct at global scope, so add_array<Type> writes it as a structured array:
+    //   CNPZ_RECORD(Sample, CNPZ_FIELD(t), CNPZ_FIELD(id), CNPZ_FIELD_AS(pos, "position"))
+    // Fields may be arithmetic, complex, fixed-size arrays or other records. Members left out become padding
+    #define CNPZ_RECORD(Type, ...) \
+        template<> \
+        struct cnpz::RecordTraits<Type> { \
+            static_assert(std::is_standard_layout_v<Type> && std::is_trivially_copyable_v<Type>, \
+                          "Records must be standard-layout and trivially copyable"); \
+            using Record = Type; \
+            static constexpr bool registered = true; \
+            static std::vector<cnpz::RecordField> fields() { return {__VA_ARGS__}; } \
+        };
+    #define CNPZ_FIELD(member) CNPZ_FIELD_AS(member, #member)
+    #define CNPZ_FIELD_AS(member, name) \
+        cnpz::RecordField{name, offsetof(Record, member), sizeof(Record::member), \
+                          cnpz::record_field_descr<decltype(Record::member)>()}
+
+    class NpzFile;
+    class NpzReader;
+    class WorkStealingPool;
+    struct ZipLocalFileHeader;
+
+    // Handle to a STORED .npy entry that grows row block by row block, from NpzFile::begin_array.
+    // The .npy header reserves room for any row count and close() patches the shape, sizes and CRC in place.
+    // No other entries can be added to the archive while it is open
+    class ArrayAppender {
+    public:
+        ArrayAppender(ArrayAppender&& other) noexcept;
+        ArrayAppender& operator=(ArrayAppender&&) = delete;
+        ~ArrayAppender();
+
+        // data holds num_rows rows of the row shape given to begin_array
+        template<typename T>
+        void append_rows(const T* data, size_t num_rows) {
+            if (sizeof(T) != type_size_) throw std::invalid_argument("Element type mismatch for " + name_);
+            append_bytes(reinterpret_cast<const char*>(data), num_rows);
+        }
+        void append_bytes(const char* data, size_t num_rows);
+        inline size_t num_rows() const { return num_rows_; }
+        // Also done by NpzFile::close
+        void close();
+    private:
+        friend class NpzFile;
+        ArrayAppender() = default;
+
+        NpzFile* npz_{nullptr};
+        std::string name_;
+        std::string type_descr_;
+        size_t type_size_{0};
+        shape_type row_shape_;
+        size_t row_size_{0};
+        size_t num_rows_{0};
+        uint32_t data_crc_{0};
+        size_t header_size_{0};
+        time_t timestamp_{0};
+        uint32_t local_header_offset_{0};
+    };
+
+    // Entries can be added from several threads at once. add_file*, add_array, add_chunked_array and add_sparse_*
+    // compress and CRC their data without locking, then reserve their range of the archive and record the central
+    // directory entry under a short lock and write with pwrite. copy_entry_from reserves its range the same way
+    // and copies into it outside the lock. Setters, begin_array and close() are for one thread. When streaming,
+    // entries are written whole under the lock, one after the other
     class NpzFile {
     public:
         // if filename does not have .npz or .zip extension, we add .npz
-        explicit NpzFile(const std::string& filename);
+        // In APPEND mode new entries go where the central directory was, a new one is written on close.
+        // Existing entries are not rewritten. Adding a name that exists makes a duplicate, readers take the last
+        explicit NpzFile(const std::string& filename, OpenMode mode = OpenMode::TRUNCATE);
+        // Streams to fd, which may be a pipe or socket, without ever seeking: DEFLATE output is written as it is
+        // produced, its sizes and CRC following the data in a data descriptor (general purpose bit 3). Entries
+        // whose sizes are known up front, such as STORED ones, have them in the local header. The fd is left open
+        explicit NpzFile(int fd);
         ~NpzFile();
+        // Waits for entries still being written by other threads
         void close();
 
         std::string full_path() const;
         inline std::string filename() const { return filename_; }
         inline int num_files() const { return num_entries_; }
+        inline bool streaming() const { return streaming_; }
 
         // We need to pass header separately so convenient to support 2 buffers
         // Returns number of bytes written for the file itself (after compression)
+        // extra_field is written as is in both the local header and the central directory
         size_t add_file_from_buffers(
             const std::string& name, const char* buf0, size_t size0, const char* buf1, size_t size1,
-            time_t timestamp = 0, CompressionMethod compression = CompressionMethod::STORED);
-        void add_file(const std::string& name, const char* data, size_t size, time_t timestamp = 0){
-            add_file_from_buffers(name, data, size, nullptr, 0, timestamp);
+            time_t timestamp = 0, CompressionMethod compression = CompressionMethod::STORED,
+            const std::string& extra_field = "");
+        void add_file(const std::string& name, const char* data, size_t size, time_t timestamp = 0,
+                      CompressionMethod compression = CompressionMethod::STORED) {
+            add_file_from_buffers(name, data, size, nullptr, 0, timestamp, compression);
+        }
+        inline void add_file(const std::string &name, const std::string& file_data, time_t timestamp = 0,
+                             CompressionMethod compression = CompressionMethod::STORED) {
+            add_file(name, file_data.c_str(), file_data.size(), timestamp, compression);
         }
-        inline void add_file(const std::string &name, const std::string& file_data, time_t timestamp = 0) {
-            add_file(name, file_data.c_str(), file_data.size(), timestamp);
+
+        // filters are applied in order to the data (not the .npy header)
+        template<typename T>
+        size_t add_array(const std::string& name, const T* data, const shape_type& shape, time_t timestamp = 0,
+                         CompressionMethod compression = CompressionMethod::STORED,
+                         const filter_list& filters = {}) {
+            return add_array_of_type(name, numpy_descr<T>(), sizeof(T), reinterpret_cast<const char*>(data), shape,
+                                     timestamp, compression, filters);
+        }
+
+        // Fast path for tiny arrays added at high rates: the whole entry is formatted on the stack and written with
+        // one call, without heap allocations once the central directory has room (see reserve_entries).
+        // DEFLATE uses a small window, entries that don't shrink are stored. Arrays over SMALL_ARRAY_MAX_SIZE
+        // bytes, long names, streaming archives and checkpoints go through add_array
+        static constexpr size_t SMALL_ARRAY_MAX_SIZE = 4096;
+        template<typename T>
+        size_t add_small_array(std::string_view name, const T* data, std::span<const size_t> shape,
+                               time_t timestamp = 0, CompressionMethod compression = CompressionMethod::STORED) {
+            return add_small_array_of_type(name, numpy_descr<T>(), sizeof(T), reinterpret_cast<const char*>(data),
+                                           shape, timestamp, compression, npy_header_formatter<T>(shape.size()));
         }
+        // Central directory room for count more entries with names of about name_size
+        void reserve_entries(size_t count, size_t name_size = 32);
+
+        // Stored in Zarr v2 layout so the archive opens with zarr.ZipStore: name/.zarray metadata plus one
+        // entry per chunk named name/i.j.k, edge chunks padded with zeros. Chunks are compressed in parallel.
+        // Returns number of bytes written for the chunks
+        template<typename T>
+        size_t add_chunked_array(const std::string& name, const T* data, const shape_type& shape,
+                                 const shape_type& chunks, time_t timestamp = 0,
+                                 CompressionMethod compression = CompressionMethod::DEFLATE) {
+            static_assert(!is_record_v<T>, "Zarr chunks of records are not supported");
+            return add_chunked_array_of_type(name, numpy_descr<T>(), sizeof(T), reinterpret_cast<const char*>(data),
+                                             shape, chunks, timestamp, compression);
+        }
+
+        // Sparse matrix as the entry set scipy.sparse.load_npz expects (format, shape, data and indices/indptr
+        // or row/col), so the archive should hold just this matrix. Indices are narrowed to int32 when the
+        // shape and nnz allow it. Entries are compressed in parallel. Returns number of bytes written
+        template<typename T, typename I>
+        size_t add_sparse_compressed(SparseFormat format, size_t rows, size_t cols, const T* data,
+                                     const I* indices, const I* indptr, size_t nnz,
+                                     CompressionMethod compression = CompressionMethod::DEFLATE) {
+            if (format == SparseFormat::COO) {
+                throw std::invalid_argument("COO matrices need add_sparse_coo");
+            }
+            size_t major = format == SparseFormat::CSR ? rows : cols;
+            std::vector<char> narrow_indices, narrow_indptr;
+            bool narrow = std::max({rows, cols, nnz}) <= INT32_MAX;
+            std::vector<ArraySpec> index_arrays{
+                index_array("indices", indices, nnz, narrow, narrow_indices),
+                index_array("indptr", indptr, major + 1, narrow, narrow_indptr)};
+            return add_sparse_of_type(format, rows, cols, numpy_descr<T>(), sizeof(T),
+                                      reinterpret_cast<const char*>(data), nnz, index_arrays, compression);
+        }
+        template<typename T, typename I>
+        size_t add_sparse_coo(size_t rows, size_t cols, const T* data, const I* row, const I* col, size_t nnz,
+                              CompressionMethod compression = CompressionMethod::DEFLATE) {
+            std::vector<char> narrow_row, narrow_col;
+            bool narrow = std::max({rows, cols, nnz}) <= INT32_MAX;
+            std::vector<ArraySpec> index_arrays{
+                index_array("row", row, nnz, narrow, narrow_row),
+                index_array("col", col, nnz, narrow, narrow_col)};
+            return add_sparse_of_type(SparseFormat::COO, rows, cols, numpy_descr<T>(), sizeof(T),
+                                      reinterpret_cast<const char*>(data), nnz, index_arrays, compression);
+        }
+
+        // Copies an entry of another archive as is, without decompressing: CRC, sizes and extra fields are
+        // reused and the data is copied with copy_file_range where possible. Returns number of bytes copied
+        size_t copy_entry_from(const NpzReader& source, const std::string& name);
+        // Copies all entries of source in order
+        size_t merge_from(const NpzReader& source);
+
+        // add_array on executor, for coroutines: co_await gives the number of bytes written.
+        // data must stay valid until then. Concurrent calls are fine, see the class comment
+        template<typename T>
+        Offload<size_t> add_array_async(Executor& executor, const std::string& name, const T* data,
+                                        const shape_type& shape, time_t timestamp = 0,
+                                        CompressionMethod compression = CompressionMethod::STORED,
+                                        const filter_list& filters = {}) {
+            return {executor, [=, this]() { return add_array(name, data, shape, timestamp, compression, filters); }};
+        }
+
+        // Incremental checkpoints: arrays added with add_array from now on carry a digest of their header, data,
+        // compression method and filters in an extra field. When base, a previous checkpoint in another file,
+        // has an entry of the same name and digest, that entry is copied instead of compressed again.
+        // A base that does not exist yet only turns the digests on
+        void set_checkpoint_base(const std::string& base_filename);
+        // Entries copied from the checkpoint base
+        inline size_t reused_entries() const { return reused_entries_.load(); }
+
+        // .npy headers of add_array, add_sparse_* and friends come from a small cache of recent (dtype, shape)
+        // pairs, so repeated shapes are not formatted again
+        inline size_t header_cache_hits() const { return header_cache_hits_.load(); }
+        inline size_t header_cache_misses() const { return header_cache_misses_.load(); }
 
+        // Starts a STORED array with rows of row_shape appended through the returned handle
         template<typename T>
-        size_t add_array(const std::string& name, const T* data, const shape_type& shape, time_t timestamp = 0) {
-            std::string type_descr = numpy_descr<T>();
-            return add_array_of_type(name, type_descr, sizeof(T), reinterpret_cast<const char*>(data), shape, timestamp);
+        ArrayAppender begin_array(const std::string& name, const shape_type& row_shape, time_t timestamp = 0) {
+            return begin_array_of_type(name, numpy_descr<T>(), sizeof(T), row_shape, timestamp);
         }
+
+        // Threads used to compress entries that can be prepared in parallel, and blocks of large DEFLATE entries.
+        // 1 by default, which compresses everything on the calling thread. Our own threads start with the first
+        // parallel write and are shared by later ones until close(), so set this and the CPU affinity before
+        // adding entries
+        inline void set_num_threads(size_t num_threads) { num_threads_ = std::max<size_t>(num_threads, 1); }
+        inline size_t num_threads() const { return num_threads_; }
+        // Runs that work on executor instead of threads of our own, num_threads() tasks at a time, so raise that too.
+        // nullptr goes back to our own threads. The executor must outlive the calls that use it
+        inline void set_executor(Executor* executor) { executor_ = executor; }
+        inline Executor* executor() const { return executor_; }
+        // Compressed entries waiting to be written draw from budget, MemoryBudget::global() by default.
+        // DEFLATE entries that don't fit are compressed straight to the output, one at a time
+        inline void set_memory_budget(MemoryBudget& budget) { memory_budget_ = &budget; }
+        inline MemoryBudget& memory_budget() const { return *memory_budget_; }
+        // CPUs our own threads are pinned to, round robin. Empty leaves them to the scheduler
+        inline void set_cpu_affinity(const std::vector<int>& cpus) { cpus_ = cpus; }
+        inline const std::vector<int>& cpu_affinity() const { return cpus_; }
+
+        // Applies to DEFLATE entries added afterwards. Adaptive state carries over between entries
+        void set_compression_policy(const CompressionPolicy& policy);
+        inline const CompressionPolicy& compression_policy() const { return policy_; }
+        // zlib level and strategy the next DEFLATE block will use
+        int current_level() const;
+        int current_strategy() const;
     private:
         // Returns number of bytes written. Adds .npy extension to name if missing
-        size_t add_array_of_type(const std::string& name, const std::string& type_descr, size_t type_size,
-                                 const char* data, const shape_type& shape, time_t timestamp = 0);
+        size_t add_array_of_type(const std::string& name, std::string_view type_descr, size_t type_size,
+                                 const char* data, const shape_type& shape, time_t timestamp = 0,
+                                 CompressionMethod compression = CompressionMethod::STORED,
+                                 const filter_list& filters = {});
+
+        // Header room of add_small_array
+        static constexpr size_t SMALL_NPY_HEADER_CAPACITY = 512;
+        using NpyHeaderFormatter = size_t (*)(char* out, std::span<const size_t> shape);
+        // NpyHeaderFormat<T, rank>::format for the usual ranks, null for others
+        template<typename T>
+        static NpyHeaderFormatter npy_header_formatter(size_t rank) {
+            if constexpr (is_record_v<T>) {
+                return nullptr;  // Descr known at run time
+            } else {
+                static_assert(NpyHeaderFormat<T, 4>::capacity <= SMALL_NPY_HEADER_CAPACITY);
+                switch (rank) {
+                    case 0: return NpyHeaderFormat<T, 0>::format;
+                    case 1: return NpyHeaderFormat<T, 1>::format;
+                    case 2: return NpyHeaderFormat<T, 2>::format;
+                    case 3: return NpyHeaderFormat<T, 3>::format;
+                    case 4: return NpyHeaderFormat<T, 4>::format;
+                    default: return nullptr;
+                }
+            }
+        }
+        // format_npy_header is used when formatter is null
+        size_t add_small_array_of_type(std::string_view name, std::string_view type_descr, size_t type_size,
+                                       const char* data, std::span<const size_t> shape, time_t timestamp,
+                                       CompressionMethod compression, NpyHeaderFormatter formatter);
+
+        struct ArraySpec {
+            std::string name;
+            std::string_view type_descr;  // From numpy_descr
+            size_t type_size;
+            const char* data;
+            shape_type shape;
+        };
+        // Prepares the arrays in parallel, written in order
+        size_t add_arrays_of_type(const std::vector<ArraySpec>& arrays, time_t timestamp,
+                                  CompressionMethod compression);
+        size_t add_sparse_of_type(SparseFormat format, size_t rows, size_t cols,
+                                  std::string_view type_descr, size_t type_size, const char* data, size_t nnz,
+                                  const std::vector<ArraySpec>& index_arrays, CompressionMethod compression);
+
+        // scipy wants signed indices, int32 when they fit. Converts into storage when I is not already that type
+        template<typename I>
+        static ArraySpec index_array(const std::string& name, const I* values, size_t count, bool narrow,
+                                     std::vector<char>& storage) {
+            static_assert(std::is_integral_v<I>, "Sparse indices must be integers");
+            if (narrow ? std::is_same_v<I, int32_t> : std::is_same_v<I, int64_t>) {
+                return {name, numpy_descr<I>(), sizeof(I), reinterpret_cast<const char*>(values), {count}};
+            }
+            size_t type_size = narrow ? sizeof(int32_t) : sizeof(int64_t);
+            storage.resize(count * type_size);
+            for (size_t i = 0; i < count; ++i) {
+                if (narrow) reinterpret_cast<int32_t*>(storage.data())[i] = static_cast<int32_t>(values[i]);
+                else reinterpret_cast<int64_t*>(storage.data())[i] = static_cast<int64_t>(values[i]);
+            }
+            return {name, narrow ? numpy_descr<int32_t>() : numpy_descr<int64_t>(), type_size, storage.data(), {count}};
+        }
 
-        static std::string create_npy_header(const std::string &type_descr, const shape_type& shape);
+        ArrayAppender begin_array_of_type(const std::string& name, std::string_view type_descr, size_t type_size,
+                                          const shape_type& row_shape, time_t timestamp);
+
+        size_t add_chunked_array_of_type(const std::string& name, std::string_view type_descr, size_t type_size,
+                                         const char* data, const shape_type& shape, const shape_type& chunks,
+                                         time_t timestamp, CompressionMethod compression);
+
+        // Computes CRC and compresses, safe to call from several threads.
+        // write_entry then appends it to the file and the central directory
+        struct PreparedEntry;
+        struct EntrySource;
+        PreparedEntry prepare_entry(const std::string& name, const char* buf0, size_t size0,
+                                    const char* buf1, size_t size1, time_t timestamp,
+                                    CompressionMethod compression, const std::string& extra_field);
+        PreparedEntry prepare_entry(EntrySource&& source);
+        // Prepares and writes the entry on this thread, or compresses it straight to the output when the memory
+        // budget can't hold it
+        size_t write_source(EntrySource&& source);
+        // Reserves room for compressing size bytes, false if the budget is exhausted
+        bool reserve_deflate(size_t size, MemoryReservation& reservation);
+        // Entry with the header fields that don't depend on the data
+        static PreparedEntry start_entry(const std::string& name, time_t timestamp, const std::string& extra_field,
+                                         size_t uncompressed_size);
+        size_t write_entry(const PreparedEntry& entry);
+        // DEFLATE entry compressed straight to the output, without buffering it: for streaming archives, and
+        // when the memory budget is exhausted (sizes and CRC are then patched into the local header)
+        size_t write_entry_streamed(const std::string& name, const char* buf0, size_t size0,
+                                    const char* buf1, size_t size1, time_t timestamp,
+                                    const std::string& extra_field);
+        // Signature, header, name and extra field
+        std::string local_header_record(const ZipLocalFileHeader& local_header, const std::string& name,
+                                        const std::string& extra_field) const;
+        void write_local_header(const ZipLocalFileHeader& local_header, const std::string& name,
+                                const std::string& extra_field);
+        // Ends a write done outside write_mutex_, keeping the first error for close()
+        void end_write(std::exception_ptr error);
+        void write_data_descriptor(const ZipLocalFileHeader& local_header);
+        void record_write_rate(size_t bytes, std::chrono::steady_clock::time_point start);
+        // Takes over the central directory of the existing archive open on fd_
+        void load_existing_entries();
+        // Copies size bytes of fd at in_offset to out_offset of the archive. When streaming they are appended
+        // instead, tracked by offset_ and under write_mutex_
+        void copy_bytes_from(int fd, uint64_t in_offset, uint64_t out_offset, size_t size);
+        // Appends at offset_, which tracks the archive size. Needs write_mutex_
+        void write_bytes(const void* data, size_t size);
+        // Patches earlier output, not possible when streaming
+        void write_at(uint64_t offset, const void* data, size_t size);
+        // Throws when the archive can't take another entry. Needs write_mutex_
+        void check_entry_count() const;
+        // Also counts the entry
+        void add_to_central_directory(const ZipLocalFileHeader& local_header, std::string_view name,
+                                      std::string_view extra_field, uint32_t local_header_offset);
+        // Calls source(0..count-1) and compresses the entries on num_threads_ threads, writes them in order.
+        // Small entries are batched, large DEFLATE entries are split in blocks compressed in parallel
+        size_t write_entries_parallel(size_t count, const std::function<EntrySource(size_t)>& source);
+        // Started on first use, stopped by close()
+        WorkStealingPool& own_pool();
+
+        // Header is padded to at least min_size
+        static std::string create_npy_header(std::string_view type_descr, std::span<const size_t> shape,
+                                             size_t min_size = 0);
+        // create_npy_header through the header cache. Hits share the cached string, which outlives its eviction
+        std::shared_ptr<const std::string> cached_npy_header(std::string_view type_descr, const shape_type& shape);
+        // Same into out, returns its size or 0 if it needs more than capacity bytes
+        static size_t format_npy_header(char* out, size_t capacity, std::string_view type_descr,
+                                        std::span<const size_t> shape, size_t min_size = 0);
+
+        // Deflates the buffers (buf1 may be null) block by block, adapting the settings between blocks.
+        // Output accumulates in the returned vector, or is handed to sink piece by piece when given
+        using DeflateSink = std::function<void(const unsigned char*, size_t)>;
+        std::vector<unsigned char> deflate_buffers(const char* buf0, size_t size0, const char* buf1, size_t size1,
+                                                   const DeflateSink& sink = {});
+        // One block of an entry split for parallel compression: head (may be null) then data, after
+        // dictionary_size bytes of preceding data. Ends with a sync flush unless last, so blocks concatenate
+        std::vector<unsigned char> deflate_block(const char* head, size_t head_size, const char* data, size_t size,
+                                                 const char* dictionary, size_t dictionary_size, bool last);
+        bool adaptive() const;  // Needs policy_mutex_
+        // Level and strategy read at once, so a concurrent adaptation can't pair one's old value with the other's new
+        std::pair<int, int> current_setting() const;
+        double target_throughput() const;
+        void adapt_setting(size_t bytes_in, size_t bytes_out, double compress_seconds);
 
         std::string filename_;
-        std::ofstream fs_;
-        std::ostringstream central_dir_;
+        int fd_{-1};
+        bool owns_fd_{true};
+        bool streaming_{false};
+        uint64_t offset_{0};
+        std::string central_dir_;  // Flat, grown ahead of the entries
         uint16_t num_entries_{0};
+        size_t num_threads_{1};
+        Executor* executor_{nullptr};
+        std::mutex pool_mutex_;
+        std::unique_ptr<WorkStealingPool> pool_;  // Our own threads, see own_pool()
+        MemoryBudget* memory_budget_{&MemoryBudget::global()};
+        std::vector<int> cpus_;
+        bool wrote_zarr_group_{false};
+        ArrayAppender* open_appender_{nullptr};
+        bool fingerprint_{false};
+        std::unique_ptr<NpzReader> checkpoint_base_;
+        std::atomic<size_t> reused_entries_{0};
+
+        friend class ArrayAppender;
+
+        std::mutex write_mutex_;  // Guards the output state above
+        std::condition_variable writes_done_;
+        size_t writes_in_flight_{0};
+        std::exception_ptr write_error_;
+
+        mutable std::mutex policy_mutex_;  // Guards the adaptive state below, deflate runs on several threads
+        CompressionPolicy policy_;
+        int setting_index_{0};        // position in the fastest-to-strongest settings ladder when adaptive
+        size_t bytes_deflated_{0};    // uncompressed bytes deflated so far, for the deadline
+        double write_rate_{0};        // smoothed output write rate in bytes per second, 0 until measured
+
+        struct CachedNpyHeader {
+            std::string type_descr;
+            shape_type shape;
+            std::shared_ptr<const std::string> header;
+        };
+        std::mutex header_cache_mutex_;  // Guards the cache below
+        std::vector<CachedNpyHeader> header_cache_;
+        size_t header_cache_next_{0};  // Replaced next once full
+        std::atomic<size_t> header_cache_hits_{0};
+        std::atomic<size_t> header_cache_misses_{0};
     };
 }
\ No newline at end of file
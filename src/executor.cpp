@@ -0,0 +1,68 @@
+#include "executor.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdexcept>
+#include <string>
+
+using namespace cnpz;
+
+void cnpz::pin_thread(std::jthread& thread, int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (cpu >= 0 && cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+    if (cpu < 0 || cpu >= CPU_SETSIZE || pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set) != 0) {
+        throw std::runtime_error("Failed to pin thread to CPU " + std::to_string(cpu));
+    }
+}
+
+ThreadPoolExecutor::ThreadPoolExecutor(size_t num_threads, const std::vector<int>& cpus)
+{
+    try {
+        for (size_t i = 0; i < std::max<size_t>(num_threads, 1); ++i) {
+            threads_.emplace_back([this]() { run(); });
+            if (!cpus.empty()) pin_thread(threads_.back(), cpus[i % cpus.size()]);
+        }
+    } catch (...) {
+        {
+            std::lock_guard lock(mutex_);
+            stopping_ = true;
+        }
+        cv_.notify_all();
+        threads_.clear();
+        throw;
+    }
+}
+
+ThreadPoolExecutor::~ThreadPoolExecutor()
+{
+    {
+        std::lock_guard lock(mutex_);
+        stopping_ = true;
+    }
+    cv_.notify_all();
+    threads_.clear();  // Joins
+}
+
+void ThreadPoolExecutor::execute(std::function<void()> task)
+{
+    {
+        std::lock_guard lock(mutex_);
+        tasks_.push_back(std::move(task));
+    }
+    cv_.notify_one();
+}
+
+void ThreadPoolExecutor::run()
+{
+    std::unique_lock lock(mutex_);
+    while (true) {
+        cv_.wait(lock, [this]() { return stopping_ || !tasks_.empty(); });
+        if (tasks_.empty()) return;
+        std::function<void()> task = std::move(tasks_.front());
+        tasks_.pop_front();
+        lock.unlock();
+        task();
+        lock.lock();
+    }
+}
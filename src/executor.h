@@ -0,0 +1,86 @@
+#pragma once
+
+// Executors run blocking archive work off the caller's thread. Offload makes such work awaitable from
+// C++20 coroutines, which resume on the executor thread that did the work
+
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace cnpz {
+    class Executor {
+    public:
+        virtual ~Executor() = default;
+        // Runs task at some point on some thread. task does not throw
+        virtual void execute(std::function<void()> task) = 0;
+    };
+
+    // Pins thread to cpu, throws if the CPU is not available
+    void pin_thread(std::jthread& thread, int cpu);
+
+    // Fixed number of std::jthreads sharing a FIFO queue, thread i pinned to cpus[i % cpus.size()] when cpus
+    // is not empty. The destructor runs the queued tasks and joins
+    class ThreadPoolExecutor : public Executor {
+    public:
+        explicit ThreadPoolExecutor(size_t num_threads = std::max(1u, std::thread::hardware_concurrency()),
+                                    const std::vector<int>& cpus = {});
+        ~ThreadPoolExecutor() override;
+        ThreadPoolExecutor(const ThreadPoolExecutor&) = delete;
+        ThreadPoolExecutor& operator=(const ThreadPoolExecutor&) = delete;
+
+        void execute(std::function<void()> task) override;
+        inline size_t num_threads() const { return threads_.size(); }
+    private:
+        void run();
+
+        std::mutex mutex_;
+        std::condition_variable cv_;
+        std::deque<std::function<void()>> tasks_;
+        bool stopping_{false};
+        std::vector<std::jthread> threads_;
+    };
+
+    // Awaitable running work() on executor: co_await suspends the coroutine, which resumes on the executor
+    // thread with the result, or the exception thrown by work()
+    template<typename R>
+    class [[nodiscard]] Offload {
+    public:
+        static_assert(!std::is_void_v<R> && !std::is_reference_v<R>, "Offload needs a value result");
+
+        Offload(Executor& executor, std::function<R()> work)
+        :
+            executor_{executor},
+            work_{std::move(work)}
+        {
+        }
+
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> handle) {
+            executor_.execute([this, handle]() {
+                try {
+                    result_.emplace(work_());
+                } catch (...) {
+                    error_ = std::current_exception();
+                }
+                handle.resume();
+            });
+        }
+        R await_resume() {
+            if (error_) std::rethrow_exception(error_);
+            return std::move(*result_);
+        }
+    private:
+        Executor& executor_;
+        std::function<R()> work_;
+        std::optional<R> result_;
+        std::exception_ptr error_;
+    };
+}
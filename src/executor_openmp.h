@@ -0,0 +1,25 @@
+#pragma once
+
+// Executor adapter for OpenMP, include where cnpz is called from OpenMP code (needs -fopenmp)
+
+#include <omp.h>
+#include <functional>
+#include "executor.h"
+
+namespace cnpz {
+    // Tasks become OpenMP tasks of the calling team, for archives written from a parallel region, typically
+    // inside a single construct while the rest of the team waits at its barrier and runs them. The writing
+    // thread itself only waits, so the team needs two threads or more.
+    // Outside a parallel region tasks run inline
+    class OpenMPExecutor : public Executor {
+    public:
+        void execute(std::function<void()> task) override {
+            if (!omp_in_parallel()) {
+                task();
+                return;
+            }
+            #pragma omp task firstprivate(task)
+            task();
+        }
+    };
+}
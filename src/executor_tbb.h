@@ -0,0 +1,21 @@
+#pragma once
+
+// Executor adapter for oneTBB, include where cnpz is used with TBB (link with TBB::tbb)
+
+#include <oneapi/tbb/task_arena.h>
+#include <functional>
+#include "executor.h"
+
+namespace cnpz {
+    // Tasks are enqueued in arena, so they share its threads and concurrency limit with the application's
+    // own TBB work
+    class TbbExecutor : public Executor {
+    public:
+        explicit TbbExecutor(oneapi::tbb::task_arena& arena) : arena_{arena} {}
+        void execute(std::function<void()> task) override {
+            arena_.enqueue(std::move(task));
+        }
+    private:
+        oneapi::tbb::task_arena& arena_;
+    };
+}
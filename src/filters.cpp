@@ -0,0 +1,280 @@
+#include "filters.h"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace cnpz;
+
+namespace {
+
+#ifdef __SSE2__
+// Interleaves vector i with vector i + n/2. Viewing the n * 16 bytes as one index, each round
+// rotates the index bits left by one, so 4 rounds turn element-major into byte-major order and
+// log2(n) rounds undo it
+inline void unpack_rounds(__m128i* v, size_t n, int rounds)
+{
+    __m128i tmp[16];
+    for (int r = 0; r < rounds; ++r) {
+        for (size_t i = 0; i < n / 2; ++i) {
+            tmp[2 * i] = _mm_unpacklo_epi8(v[i], v[i + n / 2]);
+            tmp[2 * i + 1] = _mm_unpackhi_epi8(v[i], v[i + n / 2]);
+        }
+        std::memcpy(v, tmp, n * sizeof(__m128i));
+    }
+}
+
+inline int log2_size(size_t type_size)
+{
+    switch (type_size) {
+        case 2: return 1;
+        case 4: return 2;
+        case 8: return 3;
+        case 16: return 4;
+        default: return 0;
+    }
+}
+#endif
+
+// Transposes an 8x8 bit matrix held one row per byte (Hacker's Delight 7-3)
+inline uint64_t transpose8x8(uint64_t x)
+{
+    uint64_t t;
+    t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL;
+    x = x ^ t ^ (t << 7);
+    t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL;
+    x = x ^ t ^ (t << 14);
+    t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL;
+    x = x ^ t ^ (t << 28);
+    return x;
+}
+
+// Splits each row of n bytes (n multiple of 8) into 8 bit planes of n / 8 bytes
+void bit_transpose_rows(const char* src, char* dst, size_t n, size_t rows)
+{
+    size_t plane = n / 8;
+    for (size_t r = 0; r < rows; ++r) {
+        const char* in = src + r * n;
+        char* out = dst + r * n;
+        size_t m = 0;
+#ifdef __SSE2__
+        // movemask gathers the top bit of 16 bytes at a time
+        for (; m + 2 <= plane; m += 2) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 8 * m));
+            for (int k = 7; k >= 0; --k) {
+                uint16_t mask = _mm_movemask_epi8(v);
+                std::memcpy(out + k * plane + m, &mask, 2);
+                v = _mm_add_epi8(v, v);  // Shift left by one, bit k-1 becomes the top bit
+            }
+        }
+#endif
+        for (; m < plane; ++m) {
+            uint64_t x;
+            std::memcpy(&x, in + 8 * m, 8);
+            x = transpose8x8(x);
+            for (int k = 0; k < 8; ++k) out[k * plane + m] = static_cast<char>(x >> (8 * k));
+        }
+    }
+}
+
+void bit_untranspose_rows(const char* src, char* dst, size_t n, size_t rows)
+{
+    size_t plane = n / 8;
+    for (size_t r = 0; r < rows; ++r) {
+        const char* in = src + r * n;
+        char* out = dst + r * n;
+        for (size_t m = 0; m < plane; ++m) {
+            uint64_t x = 0;
+            for (int k = 0; k < 8; ++k) x |= uint64_t(static_cast<unsigned char>(in[k * plane + m])) << (8 * k);
+            x = transpose8x8(x);
+            std::memcpy(out + 8 * m, &x, 8);
+        }
+    }
+}
+
+// Encoding only reads the input so the loops vectorize, decoding is a running sum
+template<typename U>
+void delta_encode_typed(const char* src, char* dst, size_t n)
+{
+    for (size_t i = 1; i < n; ++i) {
+        U cur, prev;
+        std::memcpy(&cur, src + i * sizeof(U), sizeof(U));
+        std::memcpy(&prev, src + (i - 1) * sizeof(U), sizeof(U));
+        cur -= prev;
+        std::memcpy(dst + i * sizeof(U), &cur, sizeof(U));
+    }
+    if (n > 0) std::memcpy(dst, src, sizeof(U));
+}
+
+template<typename U>
+void delta_decode_typed(const char* src, char* dst, size_t n)
+{
+    U sum = 0;
+    for (size_t i = 0; i < n; ++i) {
+        U d;
+        std::memcpy(&d, src + i * sizeof(U), sizeof(U));
+        sum += d;
+        std::memcpy(dst + i * sizeof(U), &sum, sizeof(U));
+    }
+}
+
+template<typename U>
+void xor_decode_typed(const char* src, char* dst, size_t n)
+{
+    U acc = 0;
+    for (size_t i = 0; i < n; ++i) {
+        U d;
+        std::memcpy(&d, src + i * sizeof(U), sizeof(U));
+        acc ^= d;
+        std::memcpy(dst + i * sizeof(U), &acc, sizeof(U));
+    }
+}
+
+}
+
+void cnpz::shuffle(const char* src, char* dst, size_t num_elements, size_t type_size)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    if (log2_size(type_size)) {
+        __m128i v[16];
+        for (; i + 16 <= num_elements; i += 16) {
+            for (size_t k = 0; k < type_size; ++k) {
+                v[k] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * type_size + 16 * k));
+            }
+            unpack_rounds(v, type_size, 4);
+            for (size_t k = 0; k < type_size; ++k) {
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + k * num_elements + i), v[k]);
+            }
+        }
+    }
+#endif
+    for (; i < num_elements; ++i) {
+        for (size_t k = 0; k < type_size; ++k) {
+            dst[k * num_elements + i] = src[i * type_size + k];
+        }
+    }
+}
+
+void cnpz::unshuffle(const char* src, char* dst, size_t num_elements, size_t type_size)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    if (int rounds = log2_size(type_size)) {
+        __m128i v[16];
+        for (; i + 16 <= num_elements; i += 16) {
+            for (size_t k = 0; k < type_size; ++k) {
+                v[k] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + k * num_elements + i));
+            }
+            unpack_rounds(v, type_size, rounds);
+            for (size_t k = 0; k < type_size; ++k) {
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * type_size + 16 * k), v[k]);
+            }
+        }
+    }
+#endif
+    for (; i < num_elements; ++i) {
+        for (size_t k = 0; k < type_size; ++k) {
+            dst[i * type_size + k] = src[k * num_elements + i];
+        }
+    }
+}
+
+void cnpz::bitshuffle(const char* src, char* dst, size_t num_elements, size_t type_size)
+{
+    size_t n = num_elements & ~size_t(7);
+    std::vector<char> bytes(n * type_size);
+    shuffle(src, bytes.data(), n, type_size);
+    bit_transpose_rows(bytes.data(), dst, n, type_size);
+    std::memcpy(dst + n * type_size, src + n * type_size, (num_elements - n) * type_size);
+}
+
+void cnpz::bitunshuffle(const char* src, char* dst, size_t num_elements, size_t type_size)
+{
+    size_t n = num_elements & ~size_t(7);
+    std::vector<char> bytes(n * type_size);
+    bit_untranspose_rows(src, bytes.data(), n, type_size);
+    unshuffle(bytes.data(), dst, n, type_size);
+    std::memcpy(dst + n * type_size, src + n * type_size, (num_elements - n) * type_size);
+}
+
+void cnpz::delta_encode(const char* src, char* dst, size_t num_elements, size_t type_size)
+{
+    switch (type_size) {
+        case 1: delta_encode_typed<uint8_t>(src, dst, num_elements); break;
+        case 2: delta_encode_typed<uint16_t>(src, dst, num_elements); break;
+        case 4: delta_encode_typed<uint32_t>(src, dst, num_elements); break;
+        case 8: delta_encode_typed<uint64_t>(src, dst, num_elements); break;
+        default: throw std::invalid_argument("Delta filter needs 1, 2, 4 or 8 byte integers");
+    }
+}
+
+void cnpz::delta_decode(const char* src, char* dst, size_t num_elements, size_t type_size)
+{
+    switch (type_size) {
+        case 1: delta_decode_typed<uint8_t>(src, dst, num_elements); break;
+        case 2: delta_decode_typed<uint16_t>(src, dst, num_elements); break;
+        case 4: delta_decode_typed<uint32_t>(src, dst, num_elements); break;
+        case 8: delta_decode_typed<uint64_t>(src, dst, num_elements); break;
+        default: throw std::invalid_argument("Delta filter needs 1, 2, 4 or 8 byte integers");
+    }
+}
+
+void cnpz::xor_encode(const char* src, char* dst, size_t num_elements, size_t type_size)
+{
+    // Byte-wise XOR with the byte one element back is the same as XOR of whole elements
+    size_t size = num_elements * type_size;
+    for (size_t i = type_size; i < size; ++i) {
+        dst[i] = src[i] ^ src[i - type_size];
+    }
+    std::memcpy(dst, src, std::min(type_size, size));
+}
+
+void cnpz::xor_decode(const char* src, char* dst, size_t num_elements, size_t type_size)
+{
+    switch (type_size) {
+        case 4: xor_decode_typed<uint32_t>(src, dst, num_elements); break;
+        case 8: xor_decode_typed<uint64_t>(src, dst, num_elements); break;
+        default: {
+            size_t size = num_elements * type_size;
+            std::memcpy(dst, src, std::min(type_size, size));
+            for (size_t i = type_size; i < size; ++i) {
+                dst[i] = src[i] ^ dst[i - type_size];
+            }
+        }
+    }
+}
+
+void cnpz::apply_filter(Filter filter, const char* src, char* dst, size_t size, size_t type_size)
+{
+    if (type_size == 0 || size % type_size != 0) {
+        throw std::invalid_argument("Filter input is not a whole number of elements");
+    }
+    switch (filter) {
+        case Filter::NONE: std::memcpy(dst, src, size); break;
+        case Filter::SHUFFLE: shuffle(src, dst, size / type_size, type_size); break;
+        case Filter::BITSHUFFLE: bitshuffle(src, dst, size / type_size, type_size); break;
+        case Filter::DELTA: delta_encode(src, dst, size / type_size, type_size); break;
+        case Filter::XOR: xor_encode(src, dst, size / type_size, type_size); break;
+        default: throw std::invalid_argument("Unknown filter");
+    }
+}
+
+void cnpz::undo_filter(Filter filter, const char* src, char* dst, size_t size, size_t type_size)
+{
+    if (type_size == 0 || size % type_size != 0) {
+        throw std::invalid_argument("Filter input is not a whole number of elements");
+    }
+    switch (filter) {
+        case Filter::NONE: std::memcpy(dst, src, size); break;
+        case Filter::SHUFFLE: unshuffle(src, dst, size / type_size, type_size); break;
+        case Filter::BITSHUFFLE: bitunshuffle(src, dst, size / type_size, type_size); break;
+        case Filter::DELTA: delta_decode(src, dst, size / type_size, type_size); break;
+        case Filter::XOR: xor_decode(src, dst, size / type_size, type_size); break;
+        default: throw std::invalid_argument("Unknown filter");
+    }
+}
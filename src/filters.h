@@ -0,0 +1,29 @@
+#pragma once
+
+// Reversible preconditioning filters applied to .npy data before compression
+
+#include <cstddef>
+#include <cstdint>
+#include "cnpz.h"
+
+namespace cnpz {
+    // Transposes bytes by significance: all first bytes of the elements, then all second bytes...
+    void shuffle(const char* src, char* dst, size_t num_elements, size_t type_size);
+    void unshuffle(const char* src, char* dst, size_t num_elements, size_t type_size);
+
+    // Transposes bits by significance, one bit plane per bit of the element.
+    // Trailing elements beyond a multiple of 8 are only byte shuffled
+    void bitshuffle(const char* src, char* dst, size_t num_elements, size_t type_size);
+    void bitunshuffle(const char* src, char* dst, size_t num_elements, size_t type_size);
+
+    // Predictors. The first element is kept as is.
+    // Delta uses wrapping arithmetic on integers of 1, 2, 4 or 8 bytes, XOR works for any type size
+    void delta_encode(const char* src, char* dst, size_t num_elements, size_t type_size);
+    void delta_decode(const char* src, char* dst, size_t num_elements, size_t type_size);
+    void xor_encode(const char* src, char* dst, size_t num_elements, size_t type_size);
+    void xor_decode(const char* src, char* dst, size_t num_elements, size_t type_size);
+
+    // Runs the filter over size bytes of elements of type_size, src and dst must not overlap
+    void apply_filter(Filter filter, const char* src, char* dst, size_t size, size_t type_size);
+    void undo_filter(Filter filter, const char* src, char* dst, size_t size, size_t type_size);
+}
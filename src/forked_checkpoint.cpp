@@ -0,0 +1,111 @@
+#include "forked_checkpoint.h"
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <stdexcept>
+
+using namespace cnpz;
+using std::string;
+
+namespace {
+// Child error messages fit in the pipe buffer, the child never blocks on them
+const size_t MAX_ERROR_SIZE = 4096;
+
+[[noreturn]] void run_child(const string& filename, const std::function<void(NpzFile&)>& write,
+                            size_t num_threads, int error_fd)
+{
+    string partial = filename + ".partial.zip";
+    string error;
+    try {
+        // The global budget's mutex may have been held by another thread of the parent, and what it counts is
+        // the parent's
+        MemoryBudget budget;
+        NpzFile npz(partial);
+        npz.set_memory_budget(budget);
+        npz.set_num_threads(num_threads);
+        write(npz);
+        npz.close();
+        if (std::rename(partial.c_str(), filename.c_str()) != 0) {
+            throw std::runtime_error("Failed to rename " + partial + " to " + filename);
+        }
+    } catch (const std::exception& e) {
+        error = e.what();
+    } catch (...) {
+        error = "Unknown error writing " + filename;
+    }
+    if (!error.empty()) {
+        ::unlink(partial.c_str());
+        error.resize(std::min(error.size(), MAX_ERROR_SIZE));
+        (void)!::write(error_fd, error.data(), error.size());
+    }
+    // Skips atexit handlers and stdio buffers, which belong to the parent
+    ::_exit(error.empty() ? 0 : 1);
+}
+}
+
+ForkedCheckpoint::ForkedCheckpoint(const string& filename, const std::function<void(NpzFile&)>& write,
+                                   size_t num_threads)
+:
+    filename_{filename.ends_with(".zip") || filename.ends_with(".npz") ? filename : filename + ".npz"}
+{
+    int fds[2];
+    if (::pipe2(fds, O_CLOEXEC) != 0) {
+        throw std::runtime_error("Failed to create pipe for: " + filename_);
+    }
+    pid_ = ::fork();
+    if (pid_ < 0) {
+        ::close(fds[0]);
+        ::close(fds[1]);
+        throw std::runtime_error("Failed to fork for: " + filename_);
+    }
+    if (pid_ == 0) {
+        ::close(fds[0]);
+        run_child(filename_, write, num_threads, fds[1]);
+    }
+    ::close(fds[1]);
+    notify_fd_ = fds[0];
+}
+
+ForkedCheckpoint::~ForkedCheckpoint()
+{
+    try {
+        wait();
+    } catch (...) {
+        // Call wait() explicitly to see errors
+    }
+    ::close(notify_fd_);
+}
+
+bool ForkedCheckpoint::done()
+{
+    if (!exited_) {
+        exited_ = ::waitpid(pid_, &status_, WNOHANG) == pid_;
+    }
+    return exited_;
+}
+
+void ForkedCheckpoint::wait()
+{
+    while (!exited_) {
+        if (::waitpid(pid_, &status_, 0) == pid_) {
+            exited_ = true;
+        } else if (errno != EINTR) {
+            throw std::runtime_error("Failed to wait for checkpoint of: " + filename_);
+        }
+    }
+    if (WIFEXITED(status_) && WEXITSTATUS(status_) == 0) return;
+
+    // The child has exited, the whole message is in the pipe
+    string error(MAX_ERROR_SIZE, '\0');
+    ssize_t n;
+    while ((n = ::read(notify_fd_, error.data(), error.size())) < 0 && errno == EINTR) {}
+    error.resize(std::max<ssize_t>(n, 0));
+    if (error.empty()) {
+        error = WIFSIGNALED(status_) ? "Checkpoint killed by signal " + std::to_string(WTERMSIG(status_))
+                                     : "Checkpoint failed";
+    }
+    status_ = 0;  // Thrown once
+    throw std::runtime_error(error + ": " + filename_);
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <sys/types.h>
+#include <functional>
+#include <string>
+#include "cnpz.h"
+
+namespace cnpz {
+    // Checkpoint written by a forked child from its copy-on-write view of memory, so the snapshot is consistent
+    // without copying: the parent goes on as soon as fork returns and only pays for the pages it modifies
+    // meanwhile. The child runs write on an NpzFile at filename + ".partial.zip" and renames it to filename
+    // when done, so filename is either the previous checkpoint or the complete new one.
+    // Linux only. Other threads of the parent don't exist in the child: write must not wait on them nor take locks
+    // they may have held at fork time (shared MemoryBudgets, executors, archives being written). The child's
+    // NpzFile has a private memory budget and compresses on num_threads threads of its own, 1 by default so
+    // it stays out of the parent's way
+    class ForkedCheckpoint {
+    public:
+        ForkedCheckpoint(const std::string& filename, const std::function<void(NpzFile&)>& write,
+                         size_t num_threads = 1);
+        // Waits for the child, errors are ignored
+        ~ForkedCheckpoint();
+        ForkedCheckpoint(const ForkedCheckpoint&) = delete;
+        ForkedCheckpoint& operator=(const ForkedCheckpoint&) = delete;
+
+        inline std::string filename() const { return filename_; }
+        inline pid_t pid() const { return pid_; }
+        // Becomes readable (EOF) when the child is done, for poll/epoll loops
+        inline int notify_fd() const { return notify_fd_; }
+        // Does not block
+        bool done();
+        // Blocks until the child is done, throws its error
+        void wait();
+    private:
+        std::string filename_;
+        pid_t pid_{-1};
+        int notify_fd_{-1};
+        bool exited_{false};
+        int status_{0};
+    };
+}
@@ -0,0 +1,65 @@
+#include "memory_budget.h"
+#include <algorithm>
+
+using namespace cnpz;
+
+MemoryBudget& MemoryBudget::global()
+{
+    static MemoryBudget budget;
+    return budget;
+}
+
+void MemoryBudget::set_limit(size_t limit)
+{
+    std::lock_guard lock(mutex_);
+    limit_ = limit;
+    released_.notify_all();
+}
+
+size_t MemoryBudget::limit() const
+{
+    std::lock_guard lock(mutex_);
+    return limit_;
+}
+
+size_t MemoryBudget::current() const
+{
+    std::lock_guard lock(mutex_);
+    return current_;
+}
+
+size_t MemoryBudget::peak() const
+{
+    std::lock_guard lock(mutex_);
+    return peak_;
+}
+
+void MemoryBudget::reset_peak()
+{
+    std::lock_guard lock(mutex_);
+    peak_ = current_;
+}
+
+void MemoryBudget::acquire(size_t bytes)
+{
+    std::unique_lock lock(mutex_);
+    released_.wait(lock, [&]() { return current_ == 0 || fits(bytes); });
+    current_ += bytes;
+    peak_ = std::max(peak_, current_);
+}
+
+bool MemoryBudget::try_acquire(size_t bytes)
+{
+    std::lock_guard lock(mutex_);
+    if (!fits(bytes)) return false;
+    current_ += bytes;
+    peak_ = std::max(peak_, current_);
+    return true;
+}
+
+void MemoryBudget::release(size_t bytes)
+{
+    std::lock_guard lock(mutex_);
+    current_ -= std::min(bytes, current_);
+    released_.notify_all();
+}
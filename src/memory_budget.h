@@ -0,0 +1,78 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <utility>
+
+namespace cnpz {
+    // Cap on the memory cnpz holds in flight: compressed entries waiting to be written, zlib states, the
+    // AsyncNpzFile queue and snapshot buffers. Writers that can't get memory compress straight to the output
+    // instead of buffering, AsyncNpzFile producers block.
+    // acquire grants a request larger than the limit when nothing else is held, so it can't wait forever
+    class MemoryBudget {
+    public:
+        explicit MemoryBudget(size_t limit = SIZE_MAX) : limit_{limit} {}
+        MemoryBudget(const MemoryBudget&) = delete;
+        MemoryBudget& operator=(const MemoryBudget&) = delete;
+
+        // Used by archives that are not given one, unlimited until set_limit
+        static MemoryBudget& global();
+
+        void set_limit(size_t limit);
+        size_t limit() const;
+        size_t current() const;
+        size_t peak() const;
+        void reset_peak();
+
+        // Blocks until bytes fit
+        void acquire(size_t bytes);
+        bool try_acquire(size_t bytes);
+        void release(size_t bytes);
+    private:
+        bool fits(size_t bytes) const { return bytes <= limit_ - std::min(limit_, current_); }
+
+        mutable std::mutex mutex_;
+        std::condition_variable released_;
+        size_t limit_;
+        size_t current_{0};
+        size_t peak_{0};
+    };
+
+    // Acquired bytes given back on destruction
+    class MemoryReservation {
+    public:
+        MemoryReservation() = default;
+        // Takes over bytes already acquired from budget
+        MemoryReservation(MemoryBudget& budget, size_t bytes) : budget_{&budget}, bytes_{bytes} {}
+        MemoryReservation(MemoryReservation&& other) noexcept
+        :
+            budget_{std::exchange(other.budget_, nullptr)},
+            bytes_{std::exchange(other.bytes_, 0)}
+        {
+        }
+        MemoryReservation& operator=(MemoryReservation&& other) noexcept {
+            if (this != &other) {
+                shrink(0);
+                budget_ = std::exchange(other.budget_, nullptr);
+                bytes_ = std::exchange(other.bytes_, 0);
+            }
+            return *this;
+        }
+        ~MemoryReservation() { shrink(0); }
+
+        inline size_t bytes() const { return bytes_; }
+        // Gives back all but bytes
+        void shrink(size_t bytes) {
+            if (budget_ && bytes < bytes_) {
+                budget_->release(bytes_ - bytes);
+                bytes_ = bytes;
+            }
+        }
+    private:
+        MemoryBudget* budget_{nullptr};
+        size_t bytes_{0};
+    };
+}
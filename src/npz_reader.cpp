@@ -0,0 +1,383 @@
+#include "npz_reader.h"
+#include "filters.h"
+#include "parallel.h"
+#include "zip_format.h"
+#include <zlib.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <numeric>
+#include <stdexcept>
+
+using namespace cnpz;
+using std::string;
+
+size_t NpyArray::num_elements() const
+{
+    return std::accumulate(shape.begin(), shape.end(), size_t(1), std::multiplies<size_t>());
+}
+
+void cnpz::read_at(int fd, uint64_t offset, char* buf, size_t size, const string& filename)
+{
+    while (size > 0) {
+        ssize_t n = ::pread(fd, buf, size, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            throw std::runtime_error("Failed to read from: " + filename);
+        }
+        buf += n;
+        size -= n;
+        offset += n;
+    }
+}
+
+ZipEndOfCentralDirectoryRecord cnpz::read_central_directory(int fd, const string& filename, string& central_dir)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        throw std::runtime_error("Failed to stat file: " + filename);
+    }
+    // End of central directory is at the end, followed by a comment of up to 64K
+    uint64_t file_size = st.st_size;
+    size_t tail_size = std::min<uint64_t>(file_size, sizeof(ZipEndOfCentralDirectoryRecord) + 0xffff);
+    string tail(tail_size, '\0');
+    read_at(fd, file_size - tail_size, tail.data(), tail_size, filename);
+    ZipEndOfCentralDirectoryRecord eocd;
+    size_t pos = tail_size < sizeof(eocd) ? string::npos : tail_size - sizeof(eocd) + 1;
+    do {
+        if (pos == 0 || pos == string::npos) {
+            throw std::runtime_error("Not a ZIP file: " + filename);
+        }
+        --pos;
+        std::memcpy(&eocd, tail.data() + pos, sizeof(eocd));
+    } while (eocd.signature != ZIP_END_OF_CENTRAL_DIRECTORY_SIG);
+
+    if (uint64_t(eocd.central_directory_offset) + eocd.central_directory_size > file_size) {
+        throw std::runtime_error("Corrupt end of central directory: " + filename);
+    }
+    central_dir.resize(eocd.central_directory_size);
+    read_at(fd, eocd.central_directory_offset, central_dir.data(), central_dir.size(), filename);
+    return eocd;
+}
+
+std::vector<ZipEntry> cnpz::parse_central_directory(const string& central_dir, size_t num_entries,
+                                                    const string& filename)
+{
+    std::vector<ZipEntry> entries;
+    const size_t record_size = 6 + sizeof(ZipLocalFileHeader) + sizeof(ZipCentralDirectoryFileHeaderSuffix);
+    size_t pos = 0;
+    for (size_t i = 0; i < num_entries; ++i) {
+        uint32_t sig;
+        ZipLocalFileHeader header;
+        ZipCentralDirectoryFileHeaderSuffix suffix;
+        if (pos + record_size > central_dir.size()) {
+            throw std::runtime_error("Truncated central directory: " + filename);
+        }
+        std::memcpy(&sig, central_dir.data() + pos, 4);
+        std::memcpy(&header, central_dir.data() + pos + 6, sizeof(header));
+        std::memcpy(&suffix, central_dir.data() + pos + 6 + sizeof(header), sizeof(suffix));
+        ZipEntry entry;
+        entry.central_directory_offset = pos;
+        pos += record_size;
+        size_t variable_size = header.filename_length + header.extra_field_length + suffix.file_comment_length;
+        if (sig != ZIP_CENTRAL_DIRECTORY_FILE_HEADER_SIG || pos + variable_size > central_dir.size()) {
+            throw std::runtime_error("Corrupt central directory: " + filename);
+        }
+        entry.name = central_dir.substr(pos, header.filename_length);
+        entry.flags = header.general_purpose_bit_flag;
+        entry.compression = static_cast<CompressionMethod>(header.compression_method);
+        entry.crc32 = header.crc32;
+        entry.compressed_size = header.compressed_size;
+        entry.uncompressed_size = header.uncompressed_size;
+        entry.local_header_offset = suffix.relative_offset_of_local_header;
+        entry.extra_field = central_dir.substr(pos + header.filename_length, header.extra_field_length);
+        pos += variable_size;
+        entries.push_back(std::move(entry));
+    }
+    return entries;
+}
+
+NpzReader::NpzReader(const string& filename)
+:
+    filename_{filename}
+{
+    fd_ = ::open(filename_.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd_ < 0) {
+        throw std::runtime_error("Failed to open file: " + filename_);
+    }
+    try {
+        string central_dir;
+        ZipEndOfCentralDirectoryRecord eocd = read_central_directory(fd_, filename_, central_dir);
+        entries_ = parse_central_directory(central_dir, eocd.num_entries_total, filename_);
+        for (size_t i = 0; i < entries_.size(); ++i) {
+            index_[entries_[i].name] = i;  // Last one wins for duplicate names, as in Python's zipfile
+        }
+    } catch (...) {
+        ::close(fd_);
+        throw;
+    }
+}
+
+NpzReader::~NpzReader()
+{
+    ::close(fd_);
+}
+
+void NpzReader::read_at(uint64_t offset, char* buf, size_t size) const
+{
+    cnpz::read_at(fd_, offset, buf, size, filename_);
+}
+
+const ZipEntry* NpzReader::find(const string& name) const
+{
+    auto it = index_.find(name);
+    return it == index_.end() ? nullptr : &entries_[it->second];
+}
+
+const ZipEntry& NpzReader::entry(const string& name) const
+{
+    const ZipEntry* entry = find(name);
+    if (!entry) {
+        throw std::runtime_error("No entry " + name + " in " + filename_);
+    }
+    return *entry;
+}
+
+uint64_t NpzReader::data_offset(const ZipEntry& entry) const
+{
+    // Local extra field may differ from the central directory one
+    uint32_t sig;
+    ZipLocalFileHeader header;
+    char buf[4 + sizeof(header)];
+    read_at(entry.local_header_offset, buf, sizeof(buf));
+    std::memcpy(&sig, buf, 4);
+    std::memcpy(&header, buf + 4, sizeof(header));
+    if (sig != ZIP_LOCAL_FILE_HEADER_SIG) {
+        throw std::runtime_error("Corrupt local header for " + entry.name + " in " + filename_);
+    }
+    return uint64_t(entry.local_header_offset) + sizeof(buf) + header.filename_length + header.extra_field_length;
+}
+
+string NpzReader::read_file(const string& name) const
+{
+    const ZipEntry& e = entry(name);
+    string compressed(e.compressed_size, '\0');
+    read_at(data_offset(e), compressed.data(), compressed.size());
+
+    string content;
+    if (e.compression == CompressionMethod::STORED) {
+        content = std::move(compressed);
+    } else if (e.compression == CompressionMethod::DEFLATE) {
+        content.resize(e.uncompressed_size);
+        z_stream strm{};
+        // Raw deflate, as in the writer
+        if (inflateInit2(&strm, -15) != Z_OK) {
+            throw std::runtime_error("Failed to initialize zlib");
+        }
+        strm.next_in = reinterpret_cast<Bytef*>(compressed.data());
+        strm.avail_in = compressed.size();
+        strm.next_out = reinterpret_cast<Bytef*>(content.data());
+        strm.avail_out = content.size();
+        int ret = inflate(&strm, Z_FINISH);
+        inflateEnd(&strm);
+        if (ret != Z_STREAM_END || strm.total_out != content.size()) {
+            throw std::runtime_error("Failed to inflate " + name + " in " + filename_);
+        }
+    } else {
+        throw std::runtime_error("Unsupported compression for " + name + " in " + filename_);
+    }
+
+    if (crc32(0u, reinterpret_cast<const Bytef*>(content.data()), content.size()) != e.crc32) {
+        throw std::runtime_error("CRC mismatch for " + name + " in " + filename_);
+    }
+    return content;
+}
+
+NpyArray NpzReader::load(const string& name) const
+{
+    string full_name = name.ends_with(".npy") ? name : name + ".npy";
+    string content = read_file(full_name);
+    NpyArray array;
+    size_t header_size = parse_npy_header(content.data(), content.size(), array);
+    const char* data = content.data() + header_size;
+    size_t data_size = content.size() - header_size;
+
+    std::string_view filter_field = find_extra_field(entry(full_name).extra_field, CNPZ_FILTER_EXTRA_ID);
+    if (filter_field.empty()) {
+        array.data.assign(data, data + data_size);
+        return array;
+    }
+    size_t type_size = static_cast<uint8_t>(filter_field[0]);
+    size_t num_filters = filter_field.size() > 1 ? static_cast<uint8_t>(filter_field[1]) : 0;
+    if (filter_field.size() != 2 + num_filters) {
+        throw std::runtime_error("Corrupt filter field for " + full_name + " in " + filename_);
+    }
+    array.data.resize(data_size);
+    std::vector<char> scratch(data, data + data_size);
+    for (size_t i = num_filters; i-- > 0;) {
+        undo_filter(static_cast<Filter>(filter_field[2 + i]), scratch.data(), array.data.data(), data_size, type_size);
+        if (i > 0) scratch.swap(array.data);
+    }
+    return array;
+}
+
+namespace {
+
+// Just enough JSON for the .zarray written by NpzFile. Returns the raw value of key
+std::string_view json_value(std::string_view json, std::string_view key)
+{
+    size_t pos = json.find("\"" + string(key) + "\"");
+    if (pos == std::string_view::npos) {
+        throw std::runtime_error("Missing key in Zarr metadata: " + string(key));
+    }
+    pos = json.find(':', pos);
+    pos = json.find_first_not_of(" \n", pos + 1);
+    size_t end = json[pos] == '[' ? json.find(']', pos) + 1 :
+                 json[pos] == '"' ? json.find('"', pos + 1) + 1 : json.find_first_of(",\n}", pos);
+    return json.substr(pos, end - pos);
+}
+
+shape_type json_sizes(std::string_view list)
+{
+    shape_type sizes;
+    for (size_t pos = 1; pos < list.size();) {
+        pos = list.find_first_of("0123456789", pos);
+        if (pos == std::string_view::npos) break;
+        size_t value = 0;
+        for (; pos < list.size() && list[pos] >= '0' && list[pos] <= '9'; ++pos) value = value * 10 + (list[pos] - '0');
+        sizes.push_back(value);
+    }
+    return sizes;
+}
+
+// Scatters a full chunk into the array at origin, clipping at the array edges
+void place_chunk(const char* chunk, char* data, const shape_type& shape, const shape_type& chunks,
+                 const shape_type& origin, size_t type_size, size_t dim = 0)
+{
+    size_t dst_stride = type_size, src_stride = type_size;
+    for (size_t d = dim + 1; d < shape.size(); ++d) {
+        dst_stride *= shape[d];
+        src_stride *= chunks[d];
+    }
+    size_t extent = std::min(chunks[dim], shape[dim] - origin[dim]);
+    data += origin[dim] * dst_stride;
+    if (dim + 1 == shape.size()) {
+        std::memcpy(data, chunk, extent * type_size);
+        return;
+    }
+    for (size_t j = 0; j < extent; ++j) {
+        place_chunk(chunk + j * src_stride, data + j * dst_stride, shape, chunks, origin, type_size, dim + 1);
+    }
+}
+
+}
+
+NpyArray NpzReader::load_chunked(const string& name, size_t num_threads) const
+{
+    string zarray = read_file(name + "/.zarray");
+    if (json_value(zarray, "compressor") != "null" || json_value(zarray, "filters") != "null" ||
+        json_value(zarray, "order") != "\"C\"") {
+        throw std::runtime_error("Unsupported Zarr array: " + name);
+    }
+    NpyArray array;
+    std::string_view dtype = json_value(zarray, "dtype");
+    array.descr = dtype.substr(1, dtype.size() - 2);
+    array.shape = json_sizes(json_value(zarray, "shape"));
+    shape_type chunks = json_sizes(json_value(zarray, "chunks"));
+    size_t type_size = std::stoul(array.descr.substr(2));
+    if (chunks.size() != array.shape.size() || array.shape.empty() || type_size == 0) {
+        throw std::runtime_error("Bad Zarr metadata for: " + name);
+    }
+    array.data.resize(array.num_elements() * type_size);
+
+    shape_type grid(chunks.size());
+    size_t num_chunks = 1, chunk_size = type_size;
+    for (size_t d = 0; d < chunks.size(); ++d) {
+        if (chunks[d] == 0) throw std::runtime_error("Bad Zarr metadata for: " + name);
+        grid[d] = (array.shape[d] + chunks[d] - 1) / chunks[d];
+        num_chunks *= grid[d];
+        chunk_size *= chunks[d];
+    }
+    parallel_for(num_chunks, num_threads, [&](size_t index) {
+        shape_type origin(chunks.size());
+        string key;
+        for (size_t d = chunks.size(), rest = index; d-- > 0;) {
+            size_t i = rest % grid[d];
+            rest /= grid[d];
+            origin[d] = i * chunks[d];
+            key = (d > 0 ? "." : "") + std::to_string(i) + key;
+        }
+        if (!find(name + "/" + key)) return;  // Fill value
+        string chunk = read_file(name + "/" + key);
+        if (chunk.size() != chunk_size) {
+            throw std::runtime_error("Bad chunk size for " + name + "/" + key);
+        }
+        place_chunk(chunk.data(), array.data.data(), array.shape, chunks, origin, type_size);
+    });
+    return array;
+}
+
+size_t cnpz::parse_npy_header(const char* buf, size_t size, NpyArray& array)
+{
+    size_t preamble_size;
+    size_t header_size = parse_npy_preamble(buf, size, preamble_size);
+    if (header_size > size) {
+        throw std::runtime_error("Truncated NPY header");
+    }
+    std::string_view dict(buf + preamble_size, header_size - preamble_size);
+
+    auto value_of = [&](std::string_view key) {
+        size_t pos = dict.find(key);
+        if (pos == std::string_view::npos) {
+            throw std::runtime_error("Missing key in NPY header: " + string(key));
+        }
+        pos = dict.find_first_not_of(' ', pos + key.size());
+        return pos == std::string_view::npos ? std::string_view{} : dict.substr(pos);
+    };
+
+    std::string_view descr = value_of("'descr':");
+    if (descr.starts_with('[')) {
+        // Structured dtype, kept as the list
+        size_t depth = 0, pos = 0;
+        bool in_string = false;
+        for (; pos < descr.size(); ++pos) {
+            char c = descr[pos];
+            if (c == '\'') in_string = !in_string;
+            else if (in_string) continue;
+            else if (c == '[' || c == '(') ++depth;
+            else if ((c == ']' || c == ')') && --depth == 0) break;
+        }
+        if (pos == descr.size()) {
+            throw std::runtime_error("Unsupported descr in NPY header");
+        }
+        array.descr = descr.substr(0, pos + 1);
+    } else {
+        size_t descr_end = descr.find('\'', 1);
+        if (descr.empty() || descr[0] != '\'' || descr_end == std::string_view::npos) {
+            throw std::runtime_error("Unsupported descr in NPY header");
+        }
+        array.descr = descr.substr(1, descr_end - 1);
+    }
+    array.fortran_order = value_of("'fortran_order':").starts_with("True");
+
+    std::string_view shape = value_of("'shape':");
+    size_t shape_end = shape.find(')');
+    if (shape.empty() || shape[0] != '(' || shape_end == std::string_view::npos) {
+        throw std::runtime_error("Bad shape in NPY header");
+    }
+    array.shape.clear();
+    for (size_t pos = 1; pos < shape_end;) {
+        pos = shape.find_first_not_of(", ", pos);
+        if (pos >= shape_end) break;
+        size_t dim = 0;
+        for (; pos < shape_end && shape[pos] >= '0' && shape[pos] <= '9'; ++pos) dim = dim * 10 + (shape[pos] - '0');
+        if (pos < shape_end && shape[pos] != ',' && shape[pos] != ' ') {
+            throw std::runtime_error("Bad shape in NPY header");
+        }
+        array.shape.push_back(dim);
+    }
+    return header_size;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "cnpz.h"
+
+namespace cnpz {
+    // Array loaded from a .npy entry
+    struct NpyArray {
+        std::string descr;
+        shape_type shape;
+        bool fortran_order{false};
+        std::vector<char> data;
+
+        size_t num_elements() const;
+        template<typename T> const T* data_as() const { return reinterpret_cast<const T*>(data.data()); }
+    };
+
+    // Central directory record of an entry
+    struct ZipEntry {
+        std::string name;
+        uint16_t flags{0};
+        CompressionMethod compression{CompressionMethod::STORED};
+        uint32_t crc32{0};
+        uint32_t compressed_size{0};
+        uint32_t uncompressed_size{0};
+        uint32_t local_header_offset{0};
+        std::string extra_field;
+        size_t central_directory_offset{0};  // Of its record, from the start of the central directory
+    };
+
+    class NpzReader {
+    public:
+        explicit NpzReader(const std::string& filename);
+        ~NpzReader();
+        NpzReader(const NpzReader&) = delete;
+        NpzReader& operator=(const NpzReader&) = delete;
+
+        inline std::string filename() const { return filename_; }
+        inline const std::vector<ZipEntry>& entries() const { return entries_; }
+        // nullptr if there is no such entry
+        const ZipEntry* find(const std::string& name) const;
+
+        // Uncompressed content of the entry, CRC checked
+        std::string read_file(const std::string& name) const;
+        // Adds .npy extension to name if missing. Undoes cnpz filters
+        NpyArray load(const std::string& name) const;
+        // load on executor, for coroutines. Loads can run concurrently
+        inline Offload<NpyArray> load_async(Executor& executor, const std::string& name) const {
+            return {executor, [this, name]() { return load(name); }};
+        }
+        // Assembles an array written by NpzFile::add_chunked_array (Zarr v2, no compressor),
+        // reading and inflating chunks on num_threads threads. Missing chunks read as zeros
+        NpyArray load_chunked(const std::string& name,
+                              size_t num_threads = std::max(1u, std::thread::hardware_concurrency())) const;
+        // Offset of the entry data, past the local header
+        uint64_t data_offset(const ZipEntry& entry) const;
+    private:
+        friend class NpzFile;  // Copies raw entries from fd_
+        const ZipEntry& entry(const std::string& name) const;
+        void read_at(uint64_t offset, char* buf, size_t size) const;
+
+        std::string filename_;
+        int fd_{-1};
+        std::vector<ZipEntry> entries_;
+        std::unordered_map<std::string, size_t> index_;
+    };
+
+    // Parses the .npy header at the start of buf into array, leaving its data alone. Returns the header size
+    size_t parse_npy_header(const char* buf, size_t size, NpyArray& array);
+}
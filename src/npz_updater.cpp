@@ -0,0 +1,165 @@
+#include "npz_updater.h"
+#include "filters.h"
+#include "zip_format.h"
+#include <zlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <numeric>
+#include <stdexcept>
+
+using namespace cnpz;
+using std::string;
+
+// Offsets of the CRC field in the records
+const size_t LOCAL_HEADER_CRC_OFFSET = 4 + offsetof(ZipLocalFileHeader, crc32);
+const size_t CENTRAL_DIRECTORY_CRC_OFFSET = 6 + offsetof(ZipLocalFileHeader, crc32);
+// Fixed part of a central directory record, the name and extra field follow
+const size_t CENTRAL_DIRECTORY_HEADER_SIZE = 6 + sizeof(ZipLocalFileHeader) +
+                                             sizeof(ZipCentralDirectoryFileHeaderSuffix);
+
+NpzUpdater::NpzUpdater(const string& filename)
+:
+    filename_{filename},
+    fd_{::open(filename.c_str(), O_RDWR | O_CLOEXEC)}
+{
+    if (fd_ < 0) {
+        throw std::runtime_error("Failed to open file: " + filename_);
+    }
+    try {
+        string central_dir;
+        ZipEndOfCentralDirectoryRecord eocd = read_central_directory(fd_, filename_, central_dir);
+        central_dir_offset_ = eocd.central_directory_offset;
+        entries_ = parse_central_directory(central_dir, eocd.num_entries_total, filename_);
+        for (size_t i = 0; i < entries_.size(); ++i) {
+            index_[entries_[i].name] = i;
+        }
+    } catch (...) {
+        ::close(fd_);
+        throw;
+    }
+}
+
+NpzUpdater::~NpzUpdater()
+{
+    ::close(fd_);
+}
+
+void NpzUpdater::sync()
+{
+    if (::fdatasync(fd_) != 0) {
+        throw std::runtime_error("Failed to sync: " + filename_);
+    }
+}
+
+void NpzUpdater::write_at(uint64_t offset, const void* data, size_t size)
+{
+    const char* p = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t n = ::pwrite(fd_, p, size, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            throw std::runtime_error("Failed to write to: " + filename_);
+        }
+        p += n;
+        size -= n;
+        offset += n;
+    }
+}
+
+void NpzUpdater::overwrite_array_of_type(const string& name, std::string_view type_descr, size_t type_size,
+                                         const char* data, const shape_type& shape)
+{
+    string full_name = name.ends_with(".npy") ? name : name + ".npy";
+    auto it = index_.find(full_name);
+    if (it == index_.end()) {
+        throw std::runtime_error("No entry " + full_name + " in " + filename_);
+    }
+    const ZipEntry& entry = entries_[it->second];
+    if (entry.compression != CompressionMethod::STORED) {
+        throw std::runtime_error("Only STORED entries can be overwritten in place: " + full_name);
+    }
+
+    // The .npy header must describe the same array
+    ZipLocalFileHeader local_header;
+    char buf[4 + sizeof(local_header)];
+    read_at(fd_, entry.local_header_offset, buf, sizeof(buf), filename_);
+    std::memcpy(&local_header, buf + 4, sizeof(local_header));
+    uint64_t data_offset = uint64_t(entry.local_header_offset) + sizeof(buf) +
+                           local_header.filename_length + local_header.extra_field_length;
+    if (entry.uncompressed_size < NPY_PREAMBLE_SIZE_V1) {
+        throw std::runtime_error("Not an NPY entry: " + full_name);
+    }
+    char npy_preamble[NPY_PREAMBLE_SIZE_V2];
+    size_t preamble_read = std::min<size_t>(sizeof(npy_preamble), entry.uncompressed_size);
+    read_at(fd_, data_offset, npy_preamble, preamble_read, filename_);
+    size_t preamble_size;
+    string npy_header(parse_npy_preamble(npy_preamble, preamble_read, preamble_size), '\0');
+    if (npy_header.size() > entry.uncompressed_size) {
+        throw std::runtime_error("Corrupt NPY header in: " + full_name);
+    }
+    read_at(fd_, data_offset, npy_header.data(), npy_header.size(), filename_);
+    NpyArray existing;
+    parse_npy_header(npy_header.data(), npy_header.size(), existing);
+    size_t data_size = std::accumulate(shape.begin(), shape.end(), size_t(1), std::multiplies<size_t>()) * type_size;
+    if (existing.descr != type_descr || existing.shape != shape || existing.fortran_order ||
+        npy_header.size() + data_size != entry.uncompressed_size) {
+        throw std::runtime_error("Dtype or shape differs from the stored array: " + full_name);
+    }
+
+    // Filtered entries get the same filters
+    const char* unfiltered = data;
+    std::vector<char> filtered, scratch;
+    std::string_view filter_field = find_extra_field(entry.extra_field, CNPZ_FILTER_EXTRA_ID);
+    if (!filter_field.empty()) {
+        size_t num_filters = filter_field.size() > 1 ? static_cast<uint8_t>(filter_field[1]) : 0;
+        if (filter_field.size() != 2 + num_filters || static_cast<uint8_t>(filter_field[0]) != type_size) {
+            throw std::runtime_error("Corrupt filter field for " + full_name + " in " + filename_);
+        }
+        filtered.assign(data, data + data_size);
+        scratch.resize(data_size);
+        for (size_t i = 0; i < num_filters; ++i) {
+            apply_filter(static_cast<Filter>(filter_field[2 + i]), filtered.data(), scratch.data(), data_size,
+                         type_size);
+            filtered.swap(scratch);
+        }
+        data = filtered.data();
+    }
+
+    uint32_t crc = crc32(0u, reinterpret_cast<const Bytef*>(npy_header.data()), npy_header.size());
+    crc = crc32(crc, reinterpret_cast<const Bytef*>(data), data_size);
+    write_at(data_offset + npy_header.size(), data, data_size);
+    if (entry.flags & ZIP_FLAG_DATA_DESCRIPTOR) {
+        // CRC is in the descriptor after the data, which may or may not start with a signature
+        uint64_t descriptor_offset = data_offset + entry.compressed_size;
+        uint32_t sig;
+        read_at(fd_, descriptor_offset, reinterpret_cast<char*>(&sig), 4, filename_);
+        write_at(descriptor_offset + (sig == ZIP_DATA_DESCRIPTOR_SIG ? 4 : 0), &crc, 4);
+    } else {
+        write_at(entry.local_header_offset + LOCAL_HEADER_CRC_OFFSET, &crc, 4);
+    }
+    write_at(central_dir_offset_ + entry.central_directory_offset + CENTRAL_DIRECTORY_CRC_OFFSET, &crc, 4);
+
+    // A checkpoint digest of the old data would let the next checkpoint reuse this entry
+    std::string_view digest_field = find_extra_field(entry.extra_field, CNPZ_DIGEST_EXTRA_ID);
+    if (!digest_field.empty()) {
+        uint64_t digest = entry_digest(npy_header, unfiltered, data_size, CompressionMethod::STORED,
+                                       filter_field.empty() ? std::string_view{} : filter_field.substr(2));
+        if (digest_field.size() != sizeof(digest)) {
+            throw std::runtime_error("Corrupt digest field for " + full_name + " in " + filename_);
+        }
+        size_t central_pos = digest_field.data() - entry.extra_field.data();
+        write_at(central_dir_offset_ + entry.central_directory_offset + CENTRAL_DIRECTORY_HEADER_SIZE +
+                 entry.name.size() + central_pos, &digest, sizeof(digest));
+        // The local copy of the extra field may be laid out differently
+        string local_extra(local_header.extra_field_length, '\0');
+        read_at(fd_, data_offset - local_extra.size(), local_extra.data(), local_extra.size(), filename_);
+        std::string_view local_digest = find_extra_field(local_extra, CNPZ_DIGEST_EXTRA_ID);
+        if (local_digest.size() == sizeof(digest)) {
+            write_at(data_offset - local_extra.size() + (local_digest.data() - local_extra.data()), &digest,
+                     sizeof(digest));
+        }
+    }
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "cnpz.h"
+#include "npz_reader.h"
+
+namespace cnpz {
+    // Overwrites the data of STORED .npy entries of an existing archive in place, for arrays rewritten with
+    // the same dtype and shape. Only the data and the CRC in the local header (or data descriptor) and the
+    // central directory are written, so the cost is the size of the array
+    class NpzUpdater {
+    public:
+        explicit NpzUpdater(const std::string& filename);
+        ~NpzUpdater();
+        NpzUpdater(const NpzUpdater&) = delete;
+        NpzUpdater& operator=(const NpzUpdater&) = delete;
+
+        inline std::string filename() const { return filename_; }
+
+        // Adds .npy extension to name if missing. Entry filters are applied again to the new data
+        template<typename T>
+        void overwrite_array(const std::string& name, const T* data, const shape_type& shape) {
+            overwrite_array_of_type(name, numpy_descr<T>(), sizeof(T), reinterpret_cast<const char*>(data), shape);
+        }
+        // fdatasync, for callers that need the update on disk
+        void sync();
+    private:
+        void overwrite_array_of_type(const std::string& name, std::string_view type_descr, size_t type_size,
+                                     const char* data, const shape_type& shape);
+        void write_at(uint64_t offset, const void* data, size_t size);
+
+        std::string filename_;
+        int fd_{-1};
+        uint32_t central_dir_offset_{0};
+        std::vector<ZipEntry> entries_;
+        std::unordered_map<std::string, size_t> index_;
+    };
+}
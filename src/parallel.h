@@ -0,0 +1,162 @@
+#pragma once
+
+// Minimal fork-join helper for independent tasks, and a work-stealing pool for tasks that spawn tasks
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "executor.h"
+
+namespace cnpz {
+    // Runs f(i) for i in [0, count) on up to num_threads threads including the caller.
+    // Rethrows the first exception, remaining tasks are skipped
+    template<typename F>
+    void parallel_for(size_t count, size_t num_threads, F&& f)
+    {
+        num_threads = std::min(num_threads, count);
+        if (num_threads <= 1) {
+            for (size_t i = 0; i < count; ++i) f(i);
+            return;
+        }
+        std::atomic<size_t> next{0};
+        std::mutex mutex;
+        std::exception_ptr error;
+        auto worker = [&]() {
+            for (size_t i; (i = next++) < count;) {
+                try {
+                    f(i);
+                } catch (...) {
+                    std::lock_guard lock(mutex);
+                    if (!error) error = std::current_exception();
+                    next = count;
+                }
+            }
+        };
+        {
+            std::vector<std::jthread> threads;
+            for (size_t t = 1; t < num_threads; ++t) threads.emplace_back(worker);
+            worker();
+        }
+        if (error) std::rethrow_exception(error);
+    }
+
+    // Each worker has its own deque: it runs its newest task first, idle workers steal the oldest task of
+    // another worker, so the subtasks a busy worker spawns spread to the others. Tasks submitted from outside
+    // the pool go to a shared queue. Worker i is pinned to cpus[i % cpus.size()] when cpus is not empty.
+    // The destructor runs the remaining tasks and joins
+    class WorkStealingPool : public Executor {
+    public:
+        using Task = std::function<void()>;
+
+        explicit WorkStealingPool(size_t num_threads, const std::vector<int>& cpus = {})
+        {
+            num_threads = std::max<size_t>(num_threads, 1);
+            for (size_t i = 0; i < num_threads; ++i) deques_.push_back(std::make_unique<Deque>());
+            try {
+                for (size_t i = 0; i < num_threads; ++i) {
+                    threads_.emplace_back([this, i]() { run(i); });
+                    if (!cpus.empty()) pin_thread(threads_.back(), cpus[i % cpus.size()]);
+                }
+            } catch (...) {
+                stop();
+                throw;
+            }
+        }
+        ~WorkStealingPool() override
+        {
+            stop();
+        }
+        WorkStealingPool(const WorkStealingPool&) = delete;
+        WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+        inline size_t num_threads() const { return deques_.size(); }
+
+        void execute(Task task) override
+        {
+            // Counted first, so a worker taking the task right away can't bring queued_ below zero
+            {
+                std::lock_guard lock(mutex_);
+                ++queued_;
+            }
+            Deque& deque = current_pool_ == this ? *deques_[current_index_] : shared_;
+            {
+                std::lock_guard lock(deque.mutex);
+                deque.tasks.push_back(std::move(task));
+            }
+            cv_.notify_one();
+        }
+    private:
+        struct Deque {
+            std::mutex mutex;
+            std::deque<Task> tasks;
+        };
+
+        void stop()
+        {
+            {
+                std::lock_guard lock(mutex_);
+                stopping_ = true;
+            }
+            cv_.notify_all();
+            threads_.clear();  // Joins
+        }
+
+        bool take(size_t self, Task& task)
+        {
+            auto pop = [&](Deque& deque, bool newest) {
+                std::lock_guard lock(deque.mutex);
+                if (deque.tasks.empty()) return false;
+                if (newest) {
+                    task = std::move(deque.tasks.back());
+                    deque.tasks.pop_back();
+                } else {
+                    task = std::move(deque.tasks.front());
+                    deque.tasks.pop_front();
+                }
+                return true;
+            };
+            if (pop(*deques_[self], true) || pop(shared_, false)) return true;
+            for (size_t i = 1; i < deques_.size(); ++i) {
+                if (pop(*deques_[(self + i) % deques_.size()], false)) return true;
+            }
+            return false;
+        }
+
+        void run(size_t self)
+        {
+            current_pool_ = this;
+            current_index_ = self;
+            while (true) {
+                Task task;
+                if (take(self, task)) {
+                    {
+                        std::lock_guard lock(mutex_);
+                        --queued_;
+                    }
+                    task();
+                    continue;
+                }
+                std::unique_lock lock(mutex_);
+                cv_.wait(lock, [this]() { return stopping_ || queued_ > 0; });
+                if (stopping_ && queued_ == 0) return;
+            }
+        }
+
+        std::vector<std::unique_ptr<Deque>> deques_;
+        Deque shared_;
+        std::mutex mutex_;
+        std::condition_variable cv_;
+        size_t queued_{0};  // Tasks in all deques
+        bool stopping_{false};
+        std::vector<std::jthread> threads_;
+        static inline thread_local WorkStealingPool* current_pool_{nullptr};
+        static inline thread_local size_t current_index_{0};
+    };
+}
@@ -0,0 +1,111 @@
+#include "xxhash64.h"
+
+#include <bit>
+#include <cstring>
+
+using namespace cnpz;
+
+namespace {
+const uint64_t PRIME1 = 11400714785074694791ULL;
+const uint64_t PRIME2 = 14029467366897019727ULL;
+const uint64_t PRIME3 = 1609587929392839161ULL;
+const uint64_t PRIME4 = 9650029242287828579ULL;
+const uint64_t PRIME5 = 2870177450012600261ULL;
+
+inline uint64_t read64(const unsigned char* p)
+{
+    uint64_t value;
+    std::memcpy(&value, p, 8);
+    return value;  // Little endian hosts only, like the rest of the writer
+}
+
+inline uint32_t read32(const unsigned char* p)
+{
+    uint32_t value;
+    std::memcpy(&value, p, 4);
+    return value;
+}
+
+inline uint64_t round(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME2;
+    return std::rotl(acc, 31) * PRIME1;
+}
+
+inline uint64_t merge_round(uint64_t acc, uint64_t value)
+{
+    acc ^= round(0, value);
+    return acc * PRIME1 + PRIME4;
+}
+}
+
+Xxh64::Xxh64(uint64_t seed)
+:
+    v_{seed + PRIME1 + PRIME2, seed + PRIME2, seed, seed - PRIME1}
+{
+}
+
+void Xxh64::update(const void* data, size_t size)
+{
+    auto p = static_cast<const unsigned char*>(data);
+    total_size_ += size;
+    if (buffered_ + size < 32) {
+        std::memcpy(buffer_ + buffered_, p, size);
+        buffered_ += size;
+        return;
+    }
+    if (buffered_ > 0) {
+        size_t n = 32 - buffered_;
+        std::memcpy(buffer_ + buffered_, p, n);
+        for (int i = 0; i < 4; ++i) v_[i] = round(v_[i], read64(buffer_ + 8 * i));
+        p += n;
+        size -= n;
+        buffered_ = 0;
+    }
+    // Four independent lanes, the compiler keeps them in registers
+    uint64_t v0 = v_[0], v1 = v_[1], v2 = v_[2], v3 = v_[3];
+    for (; size >= 32; p += 32, size -= 32) {
+        v0 = round(v0, read64(p));
+        v1 = round(v1, read64(p + 8));
+        v2 = round(v2, read64(p + 16));
+        v3 = round(v3, read64(p + 24));
+    }
+    v_[0] = v0; v_[1] = v1; v_[2] = v2; v_[3] = v3;
+    std::memcpy(buffer_, p, size);
+    buffered_ = size;
+}
+
+uint64_t Xxh64::digest() const
+{
+    uint64_t h;
+    if (total_size_ >= 32) {
+        h = std::rotl(v_[0], 1) + std::rotl(v_[1], 7) + std::rotl(v_[2], 12) + std::rotl(v_[3], 18);
+        for (uint64_t v : v_) h = merge_round(h, v);
+    } else {
+        h = v_[2] + PRIME5;  // v_[2] is the seed
+    }
+    h += total_size_;
+
+    const unsigned char* p = buffer_;
+    size_t size = buffered_;
+    for (; size >= 8; p += 8, size -= 8) {
+        h ^= round(0, read64(p));
+        h = std::rotl(h, 27) * PRIME1 + PRIME4;
+    }
+    if (size >= 4) {
+        h ^= uint64_t(read32(p)) * PRIME1;
+        h = std::rotl(h, 23) * PRIME2 + PRIME3;
+        p += 4;
+        size -= 4;
+    }
+    for (; size > 0; ++p, --size) {
+        h ^= *p * PRIME5;
+        h = std::rotl(h, 11) * PRIME1;
+    }
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    h ^= h >> 32;
+    return h;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+// XXH64 (https://github.com/Cyan4973/xxHash), streaming form, to fingerprint array data
+
+#include <cstddef>
+#include <cstdint>
+
+namespace cnpz {
+    class Xxh64 {
+    public:
+        explicit Xxh64(uint64_t seed = 0);
+        void update(const void* data, size_t size);
+        uint64_t digest() const;
+    private:
+        uint64_t v_[4];
+        unsigned char buffer_[32];
+        size_t buffered_ = 0;
+        uint64_t total_size_ = 0;
+    };
+
+    inline uint64_t xxh64(const void* data, size_t size, uint64_t seed = 0) {
+        Xxh64 hash(seed);
+        hash.update(data, size);
+        return hash.digest();
+    }
+}
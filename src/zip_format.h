@@ -0,0 +1,165 @@
+#pragma once
+
+// On-disk ZIP and NPY structures shared by the writer and the reader
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "cnpz.h"
+#include "npz_reader.h"
+#include "xxhash64.h"
+
+namespace cnpz {
+
+#define PACKED_STRUCT struct __attribute__((packed))
+
+// These struct rely on little-endian byte order
+
+const uint32_t ZIP_LOCAL_FILE_HEADER_SIG = 0x04034b50;  //PK\3\4
+const uint32_t ZIP_CENTRAL_DIRECTORY_FILE_HEADER_SIG = 0x02014b50;  //PK\1\2
+const uint32_t ZIP_END_OF_CENTRAL_DIRECTORY_SIG = 0x06054b50;  //PK\5\6
+const uint32_t ZIP_DATA_DESCRIPTOR_SIG = 0x08074b50;  //PK\7\8
+const uint16_t VERSION_MADE_BY = 20;  // Everyone uses 20
+
+// General purpose bit 3: CRC and sizes are zero in the local header and follow the data in a descriptor
+const uint16_t ZIP_FLAG_DATA_DESCRIPTOR = 1 << 3;
+
+// Zip local file header
+// Structure is:
+//   uint32_t ZIP_LOCAL_FILE_HEADER_SIG
+//   fields from ZipLocalFileHeader
+//   filename
+//   extra field
+PACKED_STRUCT ZipLocalFileHeader {
+    uint16_t version_needed_to_extract{VERSION_MADE_BY};
+    uint16_t general_purpose_bit_flag{0};
+    uint16_t compression_method{static_cast<uint16_t>(CompressionMethod::STORED)};
+    uint16_t last_mod_file_time{0};
+    uint16_t last_mod_file_date{0};
+    uint32_t crc32{0};
+    uint32_t compressed_size{0};
+    uint32_t uncompressed_size{0};
+    uint16_t filename_length{0};
+    uint16_t extra_field_length{0};
+};
+
+// Zip data descriptor, after the data of entries with ZIP_FLAG_DATA_DESCRIPTOR
+PACKED_STRUCT ZipDataDescriptor {
+    uint32_t signature{ZIP_DATA_DESCRIPTOR_SIG};  // Optional in the spec but everyone writes it
+    uint32_t crc32{0};
+    uint32_t compressed_size{0};
+    uint32_t uncompressed_size{0};
+};
+
+// Zip central directory file header
+// Structure is:
+//   uint32_t ZIP_CENTRAL_DIRECTORY_FILE_HEADER_SIG
+//   uint16_t version_made_by{20};
+//   fields from ZipLocalFileHeader
+//   fields from ZipCentralDirectoryFileHeaderSuffix
+//   filename
+//   extra field
+PACKED_STRUCT ZipCentralDirectoryFileHeaderSuffix {
+    uint16_t file_comment_length{0};
+    uint16_t disk_number_start{0};
+    uint16_t internal_file_attr{0};
+    uint32_t external_file_attr{0};
+    uint32_t relative_offset_of_local_header{0};
+};
+
+// Zip end of central directory record
+PACKED_STRUCT ZipEndOfCentralDirectoryRecord {
+    uint32_t signature{ZIP_END_OF_CENTRAL_DIRECTORY_SIG};
+    uint16_t disk_number{0};
+    uint16_t central_directory_disk_number{0};
+    uint16_t num_entries_on_disk{0};
+    uint16_t num_entries_total{0};
+    uint32_t central_directory_size{0};
+    uint32_t central_directory_offset{0};
+    uint16_t comment_size{0};
+};
+
+// pread until size bytes are read, throws on errors and EOF
+void read_at(int fd, uint64_t offset, char* buf, size_t size, const std::string& filename);
+// Locates the end of central directory record of the archive open on fd and reads the central directory
+ZipEndOfCentralDirectoryRecord read_central_directory(int fd, const std::string& filename,
+                                                      std::string& central_dir);
+std::vector<ZipEntry> parse_central_directory(const std::string& central_dir, size_t num_entries,
+                                              const std::string& filename);
+
+// cnpz-specific extra fields (IDs from the range not reserved by PKWARE)
+// Filter pipeline: uint8_t type_size, uint8_t count, count x uint8_t Filter applied in order to the .npy data
+const uint16_t CNPZ_FILTER_EXTRA_ID = 0x7a63;  // "cz"
+// Checkpoint digest: uint64_t XXH64 of the .npy header, the unfiltered data, the compression method and filters
+const uint16_t CNPZ_DIGEST_EXTRA_ID = 0x6863;  // "ch"
+
+// Value of the CNPZ_DIGEST_EXTRA_ID field, filters holds the Filter ids
+inline uint64_t entry_digest(std::string_view npy_header, const char* data, size_t data_size,
+                             CompressionMethod compression, std::string_view filters)
+{
+    Xxh64 hash;
+    hash.update(npy_header.data(), npy_header.size());
+    hash.update(data, data_size);
+    hash.update(&compression, sizeof(compression));
+    hash.update(filters.data(), filters.size());
+    return hash.digest();
+}
+
+// Returns the data of extra field id, or empty view if absent
+inline std::string_view find_extra_field(std::string_view extra, uint16_t id)
+{
+    size_t pos = 0;
+    while (pos + 4 <= extra.size()) {
+        uint16_t field_id, field_size;
+        std::memcpy(&field_id, extra.data() + pos, 2);
+        std::memcpy(&field_size, extra.data() + pos + 2, 2);
+        if (pos + 4 + field_size > extra.size()) break;
+        if (field_id == id) return extra.substr(pos + 4, field_size);
+        pos += 4 + field_size;
+    }
+    return {};
+}
+
+// NPY
+const uint32_t NPY_ARRAY_ALIGN = 64;  // Seems at some point NPY switched from 16 to 64
+
+PACKED_STRUCT NpyHeader {
+    char magic[6] = {'\x93', 'N', 'U', 'M', 'P', 'Y'};   // File name (8 bytes)
+    char major_version = 1;  // Major version
+    char minor_version = 0;  // Minor version
+    uint16_t header_len = 0;   // uint32_t in NPY 2.0 (vs uint16_t in NPY 1.0)
+};
+
+// NPY 2.0 and 3.0 (UTF-8 header) have a 32-bit header_len
+const size_t NPY_PREAMBLE_SIZE_V1 = sizeof(NpyHeader);
+const size_t NPY_PREAMBLE_SIZE_V2 = sizeof(NpyHeader) + 2;
+
+// Size of the whole NPY header from its preamble, which takes the first NPY_PREAMBLE_SIZE_V2 bytes of buf (or
+// all of size when shorter). Sets preamble_size
+inline size_t parse_npy_preamble(const char* buf, size_t size, size_t& preamble_size)
+{
+    NpyHeader npy_header;
+    if (size < sizeof(npy_header) || std::memcmp(buf, npy_header.magic, sizeof(npy_header.magic)) != 0) {
+        throw std::runtime_error("Not an NPY file");
+    }
+    std::memcpy(&npy_header, buf, sizeof(npy_header));
+    if (npy_header.major_version == 1) {
+        preamble_size = NPY_PREAMBLE_SIZE_V1;
+        return preamble_size + npy_header.header_len;
+    }
+    if (npy_header.major_version != 2 && npy_header.major_version != 3) {
+        throw std::runtime_error("Unsupported NPY version");
+    }
+    if (size < NPY_PREAMBLE_SIZE_V2) {
+        throw std::runtime_error("Truncated NPY header");
+    }
+    uint32_t header_len;
+    std::memcpy(&header_len, buf + 8, 4);
+    preamble_size = NPY_PREAMBLE_SIZE_V2;
+    return preamble_size + header_len;
+}
+
+}
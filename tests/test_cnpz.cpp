@@ -1,10 +1,49 @@
 #include <catch_amalgamated.hpp>
 #include <spdlog/spdlog.h>
 
+#include "async_npz_file.h"
 #include "cnpz.h"
+#include "executor.h"
+#include "filters.h"
+#include "forked_checkpoint.h"
+#include "memory_budget.h"
+#include "npz_reader.h"
+#include "npz_updater.h"
+#include "parallel.h"
+#include "xxhash64.h"
+
+#include <coroutine>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <future>
+#include <numeric>
+#include <thread>
+#include <unistd.h>
 
 using namespace cnpz;
 
+// Heap allocations made by each thread, for the allocation-free paths
+thread_local size_t allocations = 0;
+
+// Not inlined, or GCC pairs the free with the new expressions at call sites and warns
+[[gnu::noinline]] void* operator new(size_t size)
+{
+    ++allocations;
+    if (void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+
+[[gnu::noinline]] void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+[[gnu::noinline]] void operator delete(void* p, size_t) noexcept
+{
+    std::free(p);
+}
+
 // TODO: provide in-memory backend for these tests
 
 TEST_CASE("Simple ZIP", "[host]")
@@ -23,6 +62,976 @@ TEST_CASE("Simple ZIP", "[host]")
     CHECK(content.size() == 133);
     CHECK(content.find("Words are loud\n") == 40);
 }
+
+TEST_CASE("Adaptive compression level", "[host]")
+{
+    NpzFile npz("adaptive.npz");
+    std::vector<float> data(1 << 20);
+    for (size_t i = 0; i < data.size(); ++i) data[i] = static_cast<float>(i % 1000);
+
+    // Unreachable target walks down to the fastest setting
+    CompressionPolicy policy;
+    policy.target_throughput = 1e15;
+    policy.block_size = 1 << 16;
+    npz.set_compression_policy(policy);
+    size_t fast_size = npz.add_array("fast", data.data(), {data.size()}, 0, CompressionMethod::DEFLATE);
+    CHECK(npz.current_level() == 1);
+    CHECK(fast_size < data.size() * sizeof(float));
+
+    // Trivial target spends the headroom on ratio
+    policy.target_throughput = 1;
+    npz.set_compression_policy(policy);
+    size_t strong_size = npz.add_array("strong", data.data(), {data.size()}, 0, CompressionMethod::DEFLATE);
+    CHECK(npz.current_level() == 9);
+    CHECK(strong_size < fast_size);
+
+    // Small arrays are too quick to time, they leave the ladder where it is
+    policy.target_throughput = 1e15;
+    policy.level = 9;
+    npz.set_compression_policy(policy);
+    const size_t small_shape[] = {256};
+    for (int i = 0; i < 100; ++i) {
+        npz.add_small_array("small" + std::to_string(i), data.data(), small_shape, 0, CompressionMethod::DEFLATE);
+    }
+    CHECK(npz.current_level() == 9);
+    npz.close();
+}
+
+TEST_CASE("Shuffle filters", "[host]")
+{
+    for (size_t type_size : {1, 2, 3, 4, 8, 16}) {
+        for (size_t n : {0, 7, 16, 37, 1000}) {
+            std::vector<char> src(n * type_size), shuffled(src.size()), restored(src.size());
+            for (size_t i = 0; i < src.size(); ++i) src[i] = static_cast<char>(i * 131 + i / 7);
+            shuffle(src.data(), shuffled.data(), n, type_size);
+            for (size_t i = 0; i < n; ++i) {
+                for (size_t k = 0; k < type_size; ++k) CHECK(shuffled[k * n + i] == src[i * type_size + k]);
+            }
+            unshuffle(shuffled.data(), restored.data(), n, type_size);
+            CHECK(restored == src);
+            bitshuffle(src.data(), shuffled.data(), n, type_size);
+            bitunshuffle(shuffled.data(), restored.data(), n, type_size);
+            CHECK(restored == src);
+        }
+    }
+}
+
+TEST_CASE("Predictor filters", "[host]")
+{
+    std::vector<double> series(5000);
+    for (size_t i = 0; i < series.size(); ++i) series[i] = 20.0 + 0.001 * i;
+    std::vector<int64_t> counter(5000);
+    for (size_t i = 0; i < counter.size(); ++i) counter[i] = 1000000 + 3 * i - (i % 5);
+    {
+        NpzFile npz("predicted.npz");
+        npz.add_array("plain", series.data(), {series.size()}, 0, CompressionMethod::DEFLATE);
+        npz.add_array("series", series.data(), {series.size()}, 0, CompressionMethod::DEFLATE,
+                      {Filter::XOR, Filter::SHUFFLE});
+        npz.add_array("counter", counter.data(), {counter.size()}, 0, CompressionMethod::DEFLATE,
+                      {Filter::DELTA});
+    }
+    NpzReader reader("predicted.npz");
+    CHECK(reader.find("series.npy")->compressed_size < reader.find("plain.npy")->compressed_size);
+    NpyArray loaded = reader.load("series");
+    CHECK(std::equal(series.begin(), series.end(), loaded.data_as<double>()));
+    loaded = reader.load("counter");
+    CHECK(std::equal(counter.begin(), counter.end(), loaded.data_as<int64_t>()));
+
+    std::vector<char> bytes(3 * 11), encoded(bytes.size()), decoded(bytes.size());
+    for (size_t i = 0; i < bytes.size(); ++i) bytes[i] = static_cast<char>(i * i);
+    xor_encode(bytes.data(), encoded.data(), 11, 3);
+    xor_decode(encoded.data(), decoded.data(), 11, 3);
+    CHECK(decoded == bytes);
+    CHECK_THROWS(delta_encode(bytes.data(), encoded.data(), 11, 3));
+}
+
+TEST_CASE("Filtered NPZ round trip", "[host]")
+{
+    std::vector<float> data(10000);
+    for (size_t i = 0; i < data.size(); ++i) data[i] = 1.0f + i * 1e-4f;
+    {
+        NpzFile npz("filtered.npz");
+        npz.add_array("plain", data.data(), {100, 100}, 0, CompressionMethod::DEFLATE);
+        npz.add_array("shuffled", data.data(), {100, 100}, 0, CompressionMethod::DEFLATE, {Filter::SHUFFLE});
+        npz.add_array("bitshuffled", data.data(), {data.size()}, 0, CompressionMethod::STORED,
+                      {Filter::BITSHUFFLE});
+    }
+    NpzReader reader("filtered.npz");
+    CHECK(reader.entries().size() == 3);
+    CHECK(reader.find("shuffled.npy")->compressed_size < reader.find("plain.npy")->compressed_size);
+    for (const char* name : {"plain", "shuffled", "bitshuffled"}) {
+        NpyArray array = reader.load(name);
+        CHECK(array.descr == "<f4");
+        CHECK(array.num_elements() == data.size());
+        CHECK(std::equal(data.begin(), data.end(), array.data_as<float>()));
+    }
+    CHECK(reader.load("plain").shape == shape_type{100, 100});
+}
+
+TEST_CASE("Chunked array", "[host]")
+{
+    shape_type shape{50, 33, 7};
+    std::vector<int32_t> data(50 * 33 * 7);
+    for (size_t i = 0; i < data.size(); ++i) data[i] = static_cast<int32_t>(i);
+    {
+        NpzFile npz("chunked.zip");
+        npz.set_num_threads(3);
+        npz.add_chunked_array("cube", data.data(), shape, {16, 16, 7});
+        npz.add_array("flat", data.data(), {data.size()});
+    }
+    NpzReader reader("chunked.zip");
+    CHECK(reader.find(".zgroup"));
+    CHECK(reader.find("cube/.zarray"));
+    CHECK(reader.find("cube/3.2.0"));
+    CHECK(!reader.find("cube/4.0.0"));
+    NpyArray cube = reader.load_chunked("cube", 2);
+    CHECK(cube.descr == "<i4");
+    CHECK(cube.shape == shape);
+    CHECK(std::equal(data.begin(), data.end(), cube.data_as<int32_t>()));
+}
+
+TEST_CASE("Sparse matrices", "[host]")
+{
+    // [[1, 0, 2], [0, 0, 3]]
+    std::vector<double> data{1, 2, 3};
+    std::vector<int64_t> indices{0, 2, 2}, indptr{0, 2, 3};
+    {
+        NpzFile npz("csr.npz");
+        npz.add_sparse_compressed(SparseFormat::CSR, 2, 3, data.data(), indices.data(), indptr.data(), data.size());
+        CHECK(npz.num_files() == 5);
+    }
+    NpzReader csr("csr.npz");
+    NpyArray format = csr.load("format");
+    CHECK(format.descr == "|S3");
+    CHECK(format.shape.empty());
+    CHECK(std::string(format.data.begin(), format.data.end()) == "csr");
+    NpyArray shape = csr.load("shape");
+    CHECK(shape.descr == "<i8");
+    CHECK(shape.data_as<int64_t>()[0] == 2);
+    CHECK(shape.data_as<int64_t>()[1] == 3);
+    NpyArray loaded = csr.load("indptr");
+    CHECK(loaded.descr == "<i4");  // Narrowed
+    CHECK(loaded.shape == shape_type{3});
+    CHECK(loaded.data_as<int32_t>()[2] == 3);
+    CHECK(csr.load("data").data_as<double>()[2] == 3);
+
+    std::vector<uint32_t> row{0, 0, 1}, col{0, 2, 2};
+    {
+        NpzFile npz("coo.npz");
+        npz.add_sparse_coo(2, 3, data.data(), row.data(), col.data(), data.size());
+    }
+    NpzReader coo("coo.npz");
+    CHECK(coo.load("row").descr == "<i4");
+    CHECK(coo.load("col").data_as<int32_t>()[1] == 2);
+    CHECK(coo.find("indptr.npy") == nullptr);
+}
+
+TEST_CASE("Append rows", "[host]")
+{
+    std::vector<float> rows(3 * 4);
+    for (size_t i = 0; i < rows.size(); ++i) rows[i] = static_cast<float>(i);
+    {
+        NpzFile npz("appended.npz");
+        npz.add_array("before", rows.data(), {3, 4});
+        ArrayAppender log = npz.begin_array<float>("log", {4});
+        CHECK_THROWS(npz.add_array("during", rows.data(), {3, 4}));
+        for (int step = 0; step < 1000; ++step) log.append_rows(rows.data(), 3);
+        CHECK(log.num_rows() == 3000);
+        log.close();
+        npz.add_array("after", rows.data(), {3, 4});
+        ArrayAppender unfinished = npz.begin_array<float>("unfinished", {2, 2});
+        unfinished.append_rows(rows.data(), 1);
+    }  // Closing the archive closes the appender
+    NpzReader reader("appended.npz");
+    NpyArray log = reader.load("log");
+    CHECK(log.shape == shape_type{3000, 4});
+    CHECK(log.data_as<float>()[4 * 2999 + 3] == 11.0f);
+    CHECK(reader.load("after").num_elements() == 12);
+    CHECK(reader.load("unfinished").shape == shape_type{1, 2, 2});
+
+    // Closing the archive closes the appender an open array was moved into
+    {
+        NpzFile npz("moved.npz");
+        ArrayAppender first = npz.begin_array<float>("log", {4});
+        first.append_rows(rows.data(), 1);
+        ArrayAppender moved(std::move(first));
+        moved.append_rows(rows.data() + 4, 2);
+        npz.close();
+    }
+    NpyArray moved = NpzReader("moved.npz").load("log");
+    CHECK(moved.shape == shape_type{3, 4});
+    CHECK(moved.data_as<float>()[11] == 11.0f);
+}
+
+TEST_CASE("Streaming to a pipe", "[host]")
+{
+    int fds[2];
+    REQUIRE(pipe(fds) == 0);
+    std::vector<double> data(200000);
+    for (size_t i = 0; i < data.size(); ++i) data[i] = static_cast<double>(i % 100);
+
+    // Pipes can't seek, so this fails if the writer ever tries to
+    std::thread writer([&]() {
+        NpzFile npz(fds[1]);
+        CHECK(npz.streaming());
+        npz.add_array("deflated", data.data(), {data.size()}, 0, CompressionMethod::DEFLATE);
+        npz.add_array("stored", data.data(), {1000, 200});
+        CHECK_THROWS(npz.begin_array<double>("log", {2}));
+        npz.close();
+        ::close(fds[1]);
+    });
+    std::string archive;
+    char buf[65536];
+    for (ssize_t n; (n = ::read(fds[0], buf, sizeof(buf))) > 0;) archive.append(buf, n);
+    writer.join();
+    ::close(fds[0]);
+    std::ofstream("streamed.npz", std::ios::binary) << archive;
+
+    NpzReader reader("streamed.npz");
+    CHECK(reader.find("deflated.npy")->flags & (1 << 3));
+    CHECK(reader.find("deflated.npy")->compressed_size < data.size() * sizeof(double) / 4);
+    // STORED sizes are known before the header is written, streaming readers need them there
+    const ZipEntry* stored = reader.find("stored.npy");
+    CHECK_FALSE(stored->flags & (1 << 3));
+    uint32_t local_size;
+    std::memcpy(&local_size, archive.data() + stored->local_header_offset + 18, sizeof(local_size));
+    CHECK(local_size == stored->compressed_size);
+    for (const char* name : {"deflated", "stored"}) {
+        NpyArray array = reader.load(name);
+        CHECK(std::equal(data.begin(), data.end(), array.data_as<double>()));
+    }
+}
+
+TEST_CASE("Append mode", "[host]")
+{
+    std::vector<int16_t> data{1, 2, 3, 4, 5, 6};
+    {
+        NpzFile npz("grow.npz");
+        npz.add_array("first", data.data(), {2, 3}, 0, CompressionMethod::DEFLATE);
+        npz.add_chunked_array("chunked", data.data(), {6}, {4});
+    }
+    auto size_before = std::filesystem::file_size("grow.npz");
+    {
+        NpzFile npz("grow.npz", OpenMode::APPEND);
+        CHECK(npz.num_files() == 5);
+        npz.add_array("second", data.data(), {6});
+        npz.add_chunked_array("more", data.data(), {6}, {6});
+    }
+    CHECK(std::filesystem::file_size("grow.npz") > size_before);
+    {
+        NpzFile npz("grow.npz", OpenMode::APPEND);  // Nothing added, still valid
+    }
+    NpzReader reader("grow.npz");
+    CHECK(reader.entries().size() == 8);  // Second .zgroup not written
+    CHECK(reader.load("first").shape == shape_type{2, 3});
+    CHECK(reader.load("second").data_as<int16_t>()[5] == 6);
+    CHECK(reader.load_chunked("chunked").data_as<int16_t>()[4] == 5);
+}
+
+TEST_CASE("Overwrite in place", "[host]")
+{
+    std::vector<float> weights(64, 1.0f), bias(8, 0.5f);
+    {
+        NpzFile npz("params.npz");
+        npz.add_array("weights", weights.data(), {8, 8});
+        npz.add_array("bias", bias.data(), {8}, 0, CompressionMethod::STORED, {Filter::SHUFFLE});
+        npz.add_array("frozen", bias.data(), {8}, 0, CompressionMethod::DEFLATE);
+    }
+    auto size_before = std::filesystem::file_size("params.npz");
+    for (float& w : weights) w *= 3;
+    for (float& b : bias) b += 1;
+    {
+        NpzUpdater updater("params.npz");
+        updater.overwrite_array("weights", weights.data(), {8, 8});
+        updater.overwrite_array("bias", bias.data(), {8});
+        CHECK_THROWS(updater.overwrite_array("weights", weights.data(), {64}));
+        CHECK_THROWS(updater.overwrite_array("frozen", bias.data(), {8}));
+    }
+    CHECK(std::filesystem::file_size("params.npz") == size_before);
+    NpzReader reader("params.npz");  // CRCs are checked on load
+    CHECK(reader.load("weights").data_as<float>()[63] == 3.0f);
+    CHECK(reader.load("bias").data_as<float>()[7] == 1.5f);
+}
+
+TEST_CASE("Merge archives", "[host]")
+{
+    std::vector<double> data(5000);
+    for (size_t i = 0; i < data.size(); ++i) data[i] = i * 0.5;
+    {
+        NpzFile npz("part1.npz");
+        npz.add_array("a", data.data(), {data.size()}, 0, CompressionMethod::DEFLATE, {Filter::XOR});
+        npz.add_chunked_array("c", data.data(), {data.size()}, {1024});
+    }
+    {
+        NpzFile npz("part2.npz");
+        npz.add_array("b", data.data(), {50, 100});
+        npz.add_chunked_array("d", data.data(), {data.size()}, {4096});
+    }
+    {
+        NpzFile merged("merged.npz");
+        merged.merge_from(NpzReader("part1.npz"));
+        NpzReader part2("part2.npz");
+        merged.copy_entry_from(part2, "b.npy");
+        merged.merge_from(part2);
+    }
+    NpzReader reader("merged.npz");
+    CHECK(reader.entries().size() == 13);  // b twice, one .zgroup
+    CHECK(std::equal(data.begin(), data.end(), reader.load("a").data_as<double>()));
+    CHECK(std::equal(data.begin(), data.end(), reader.load("b").data_as<double>()));
+    CHECK(std::equal(data.begin(), data.end(), reader.load_chunked("c").data_as<double>()));
+    CHECK(std::equal(data.begin(), data.end(), reader.load_chunked("d").data_as<double>()));
+
+    // Copies run alongside other writers
+    {
+        NpzFile merged("merged_concurrent.npz");
+        NpzReader part1("part1.npz");
+        std::jthread copier([&]() {
+            for (int i = 0; i < 20; ++i) merged.copy_entry_from(part1, "a.npy");
+        });
+        for (int i = 0; i < 20; ++i) merged.add_array("x" + std::to_string(i), data.data(), {data.size()});
+    }
+    NpzReader concurrent("merged_concurrent.npz");
+    CHECK(concurrent.entries().size() == 40);
+    CHECK(std::equal(data.begin(), data.end(), concurrent.load("a").data_as<double>()));
+    CHECK(std::equal(data.begin(), data.end(), concurrent.load("x19").data_as<double>()));
+}
+
+TEST_CASE("Incremental checkpoints", "[host]")
+{
+    CHECK(xxh64("", 0) == 0xef46db3751d8e999ULL);
+    CHECK(xxh64("abc", 3) == 0x44bc2cf5ad770999ULL);
+    std::vector<char> bytes(1000);
+    for (size_t i = 0; i < bytes.size(); ++i) bytes[i] = static_cast<char>(i * 7);
+    Xxh64 pieces;
+    pieces.update(bytes.data(), 5);
+    pieces.update(bytes.data() + 5, 40);
+    pieces.update(bytes.data() + 45, bytes.size() - 45);
+    CHECK(pieces.digest() == xxh64(bytes.data(), bytes.size()));
+
+    std::vector<float> weights(10000), bias(100, 1.0f), step(1);
+    for (size_t i = 0; i < weights.size(); ++i) weights[i] = std::sin(i * 0.01f);
+    auto checkpoint = [&](const std::string& filename, const std::string& base) {
+        NpzFile npz(filename);
+        npz.set_checkpoint_base(base);
+        npz.add_array("weights", weights.data(), {100, 100}, 0, CompressionMethod::DEFLATE, {Filter::SHUFFLE});
+        npz.add_array("bias", bias.data(), {bias.size()}, 0, CompressionMethod::DEFLATE);
+        npz.add_array("step", step.data(), {1});
+        return npz.reused_entries();
+    };
+    std::filesystem::remove("checkpoint0.npz");
+    CHECK(checkpoint("checkpoint1.npz", "checkpoint0.npz") == 0);
+    step[0] = 1;
+    CHECK(checkpoint("checkpoint2.npz", "checkpoint1.npz") == 2);
+    bias[3] = 2;
+    CHECK(checkpoint("checkpoint3.npz", "checkpoint2.npz") == 2);  // Copies of copies keep their digest
+
+    NpzReader reader("checkpoint3.npz");
+    CHECK(std::equal(weights.begin(), weights.end(), reader.load("weights").data_as<float>()));
+    CHECK(std::equal(bias.begin(), bias.end(), reader.load("bias").data_as<float>()));
+    CHECK(reader.load("step").data_as<float>()[0] == 1);
+
+    // Overwritten in place, the entry gets a digest of its new data
+    {
+        NpzFile npz("checkpoint4.npz");
+        npz.set_checkpoint_base("checkpoint3.npz");
+        npz.add_array("step", step.data(), {1});
+    }
+    step[0] = 3;
+    NpzUpdater("checkpoint4.npz").overwrite_array("step", step.data(), {1});
+    step[0] = 1;
+    {
+        NpzFile npz("checkpoint5.npz");
+        npz.set_checkpoint_base("checkpoint4.npz");
+        npz.add_array("step", step.data(), {1});
+        npz.close();
+        CHECK(npz.reused_entries() == 0);
+    }
+    CHECK(NpzReader("checkpoint5.npz").load("step").data_as<float>()[0] == 1);
+    step[0] = 3;
+    {
+        NpzFile npz("checkpoint6.npz");
+        npz.set_checkpoint_base("checkpoint4.npz");
+        npz.add_array("step", step.data(), {1});
+        npz.close();
+        CHECK(npz.reused_entries() == 1);  // The new digest matches
+    }
+    CHECK(NpzReader("checkpoint6.npz").load("step").data_as<float>()[0] == 3);
+}
+
+TEST_CASE("Concurrent writers", "[host]")
+{
+    const size_t num_producers = 6, arrays_per_producer = 20;
+    std::vector<std::vector<int32_t>> fields(num_producers * arrays_per_producer);
+    for (size_t i = 0; i < fields.size(); ++i) {
+        fields[i].resize(1000 + 37 * i);
+        for (size_t j = 0; j < fields[i].size(); ++j) fields[i][j] = static_cast<int32_t>(i * 100000 + j / 3);
+    }
+    {
+        NpzFile npz("concurrent.npz");
+        npz.set_num_threads(1);  // Parallelism comes from the producers
+        std::vector<std::jthread> producers;
+        for (size_t p = 0; p < num_producers; ++p) {
+            producers.emplace_back([&, p]() {
+                for (size_t k = 0; k < arrays_per_producer; ++k) {
+                    size_t i = p * arrays_per_producer + k;
+                    auto compression = i % 2 ? CompressionMethod::DEFLATE : CompressionMethod::STORED;
+                    npz.add_array("field" + std::to_string(i), fields[i].data(), {fields[i].size()}, 0,
+                                  compression, i % 3 ? filter_list{} : filter_list{Filter::DELTA});
+                    if (k == 0) npz.add_chunked_array("chunked" + std::to_string(p), fields[i].data(),
+                                                      {fields[i].size()}, {256});
+                }
+            });
+        }
+    }
+    NpzReader reader("concurrent.npz");
+    size_t num_entries = fields.size() + 1;  // .zgroup once
+    for (size_t p = 0; p < num_producers; ++p) {
+        num_entries += 1 + (fields[p * arrays_per_producer].size() + 255) / 256;
+        CHECK(std::equal(fields[p * arrays_per_producer].begin(), fields[p * arrays_per_producer].end(),
+                         reader.load_chunked("chunked" + std::to_string(p)).data_as<int32_t>()));
+    }
+    CHECK(reader.entries().size() == num_entries);
+    for (size_t i = 0; i < fields.size(); ++i) {
+        NpyArray array = reader.load("field" + std::to_string(i));
+        REQUIRE(array.num_elements() == fields[i].size());
+        CHECK(std::equal(fields[i].begin(), fields[i].end(), array.data_as<int32_t>()));
+    }
+}
+
+TEST_CASE("Background writer", "[host]")
+{
+    std::vector<double> field(100000);
+    {
+        AsyncNpzFile npz("async.npz", 2 * field.size() * sizeof(double), 2);
+        for (int step = 0; step < 10; ++step) {
+            std::fill(field.begin(), field.end(), step);  // Reused right away
+            npz.add_array("field" + std::to_string(step), field.data(), {field.size()}, 0,
+                          CompressionMethod::DEFLATE);
+            CHECK(npz.queued_bytes() <= npz.max_queued_bytes());
+        }
+        npz.add_array("moved", std::vector<int64_t>{1, 2, 3}, {3});
+        npz.flush();
+        CHECK(npz.queued_bytes() == 0);
+
+        // Errors surface on the next call, the archive stays usable
+        npz.add_array(std::string(0x10000, 'x'), field.data(), {1});
+        CHECK_THROWS_AS(npz.flush(), std::runtime_error);
+        npz.add_array("last", field.data(), {1});
+        npz.close();
+    }
+    NpzReader reader("async.npz");
+    CHECK(reader.entries().size() == 12);
+    for (int step = 0; step < 10; ++step) {
+        NpyArray array = reader.load("field" + std::to_string(step));
+        CHECK(std::all_of(array.data_as<double>(), array.data_as<double>() + field.size(),
+                          [&](double value) { return value == step; }));
+    }
+    CHECK(reader.load("moved").data_as<int64_t>()[2] == 3);
+}
+
+TEST_CASE("Snapshot buffer pool", "[host]")
+{
+    std::vector<float> field(600000);  // Past the non-temporal copy threshold
+    std::vector<float> small(1001);
+    {
+        AsyncNpzFile npz("snapshot.npz", 4 * field.size() * sizeof(float));
+        npz.set_copy_threads(3);
+        for (int step = 0; step < 6; ++step) {
+            for (size_t i = 0; i < field.size(); ++i) field[i] = step + i * 1e-3f;
+            std::fill(small.begin(), small.end(), -step);
+            npz.add_array_snapshot("field" + std::to_string(step), field.data(), {field.size()});
+            npz.add_array_snapshot("small" + std::to_string(step), small.data() + 1, {small.size() - 1});
+        }
+        npz.flush();
+        CHECK(npz.pooled_bytes() > 0);
+        CHECK(npz.pooled_bytes() <= npz.max_queued_bytes());
+    }
+    NpzReader reader("snapshot.npz");
+    for (int step = 0; step < 6; ++step) {
+        NpyArray array = reader.load("field" + std::to_string(step));
+        bool same = true;
+        for (size_t i = 0; i < field.size(); ++i) same &= array.data_as<float>()[i] == step + i * 1e-3f;
+        CHECK(same);
+        CHECK(reader.load("small" + std::to_string(step)).data_as<float>()[999] == -step);
+    }
+
+    // A larger idle buffer is not reused for a smaller array, whose copy reserved only its own size
+    MemoryBudget budget;
+    AsyncNpzFile npz("snapshot_sizes.npz", 4 * field.size() * sizeof(float));
+    npz.file().set_memory_budget(budget);
+    npz.add_array_snapshot("field", field.data(), {field.size()});
+    npz.flush();
+    npz.add_array_snapshot("small", small.data(), {small.size()});
+    npz.flush();
+    CHECK(npz.pooled_bytes() == (field.size() + small.size()) * sizeof(float));
+    CHECK(budget.current() == npz.pooled_bytes());
+    npz.close();
+    CHECK(budget.current() == 0);
+}
+
+TEST_CASE("Forked checkpoint", "[host]")
+{
+    std::vector<int64_t> state(200000);
+    std::iota(state.begin(), state.end(), 0);
+    std::filesystem::remove("forked.npz");
+    {
+        ForkedCheckpoint checkpoint("forked", [&](NpzFile& npz) {
+            npz.add_array("state", state.data(), {state.size()}, 0, CompressionMethod::DEFLATE);
+        });
+        CHECK(checkpoint.filename() == "forked.npz");
+        std::fill(state.begin(), state.end(), -1);  // The child keeps its own view
+        checkpoint.wait();
+        CHECK(checkpoint.done());
+    }
+    NpzReader reader("forked.npz");
+    NpyArray saved = reader.load("state");
+    CHECK(saved.data_as<int64_t>()[0] == 0);
+    CHECK(saved.data_as<int64_t>()[state.size() - 1] == int64_t(state.size() - 1));
+
+    // A failed checkpoint leaves the previous one in place
+    ForkedCheckpoint failed("forked.npz", [&](NpzFile& npz) {
+        npz.add_array("state", state.data(), {state.size()});
+        throw std::runtime_error("out of space");
+    });
+    std::string error;
+    try {
+        failed.wait();
+    } catch (const std::runtime_error& e) {
+        error = e.what();
+    }
+    CHECK(error.find("out of space") != std::string::npos);
+    CHECK(NpzReader("forked.npz").load("state").data_as<int64_t>()[1] == 1);
+    CHECK(!std::filesystem::exists("forked.npz.partial.zip"));
+
+    // The child doesn't share the parent's memory budget
+    MemoryBudget& global = MemoryBudget::global();
+    global.set_limit(1 << 20);
+    global.acquire(1 << 20);
+    ForkedCheckpoint isolated("forked.npz", [&](NpzFile& npz) {
+        if (&npz.memory_budget() == &global) throw std::runtime_error("shared budget");
+        npz.add_array("state", state.data(), {state.size()}, 0, CompressionMethod::DEFLATE);
+        if (npz.memory_budget().peak() == 0) throw std::runtime_error("streamed");
+    });
+    CHECK_NOTHROW(isolated.wait());
+    global.release(1 << 20);
+    global.set_limit(SIZE_MAX);
+    CHECK(NpzReader("forked.npz").load("state").data_as<int64_t>()[1] == -1);
+}
+
+TEST_CASE("Work-stealing writer", "[host]")
+{
+    // Tasks spawned from tasks, all run by the time the pool is destroyed
+    std::atomic<size_t> sum{0};
+    {
+        WorkStealingPool pool(3);
+        for (size_t i = 0; i < 10; ++i) {
+            pool.execute([&, i]() {
+                for (size_t j = 0; j < 100; ++j) pool.execute([&, i, j]() { sum += i * 100 + j; });
+            });
+        }
+    }
+    CHECK(sum == 999 * 1000 / 2);
+
+    // A large entry split in blocks and many tiny chunks batched, on 4 threads
+    std::vector<int32_t> large(3 * 1024 * 1024 + 12345);
+    for (size_t i = 0; i < large.size(); ++i) large[i] = static_cast<int32_t>(i / 64 + (i % 7));
+    {
+        NpzFile npz("blocks.npz");
+        npz.set_num_threads(4);
+        npz.add_array("large", large.data(), {large.size()}, 0, CompressionMethod::DEFLATE);
+        npz.add_chunked_array("tiny", large.data(), {large.size() / 16}, {64});
+    }
+    NpzReader reader("blocks.npz");
+    CHECK(reader.find("large.npy")->compressed_size < large.size());
+    CHECK(std::equal(large.begin(), large.end(), reader.load("large").data_as<int32_t>()));
+    CHECK(std::equal(large.begin(), large.begin() + large.size() / 16, reader.load_chunked("tiny").data_as<int32_t>()));
+
+    // The archive's threads are started once and kept until close()
+    auto count_threads = []() {
+        auto tasks = std::filesystem::directory_iterator("/proc/self/task");
+        return std::distance(std::filesystem::begin(tasks), std::filesystem::end(tasks));
+    };
+    auto threads_before = count_threads();
+    NpzFile npz("reused.npz");
+    npz.set_num_threads(4);
+    npz.add_array("a", large.data(), {large.size()}, 0, CompressionMethod::DEFLATE);
+    auto threads_started = count_threads();
+    CHECK(threads_started == threads_before + 4);
+    npz.add_array("b", large.data(), {large.size()}, 0, CompressionMethod::DEFLATE);
+    CHECK(count_threads() == threads_started);
+    npz.close();
+    CHECK(count_threads() == threads_before);
+}
+
+// Eagerly started coroutine reporting its end through a promise
+struct Detached {
+    struct promise_type {
+        Detached get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+Detached export_arrays(ThreadPoolExecutor& executor, NpzFile& npz, const std::vector<double>& data,
+                       std::promise<size_t>& done)
+{
+    size_t written = 0;
+    shape_type shape{data.size()};
+    for (int i = 0; i < 4; ++i) {
+        written += co_await npz.add_array_async(executor, "a" + std::to_string(i), data.data(), shape, 0,
+                                                CompressionMethod::DEFLATE);
+    }
+    done.set_value(written);
+}
+
+Detached import_array(ThreadPoolExecutor& executor, const NpzReader& reader, std::string name,
+                      std::promise<NpyArray>& done)
+{
+    try {
+        done.set_value(co_await reader.load_async(executor, name));
+    } catch (...) {
+        done.set_exception(std::current_exception());
+    }
+}
+
+TEST_CASE("Coroutine API", "[host]")
+{
+    std::vector<double> data(20000);
+    std::iota(data.begin(), data.end(), 0.0);
+    ThreadPoolExecutor executor(2);
+    {
+        NpzFile npz("coroutines.npz");
+        npz.set_num_threads(1);
+        std::promise<size_t> first, second;
+        export_arrays(executor, npz, data, first);
+        export_arrays(executor, npz, data, second);  // Interleaves with the first
+        CHECK(first.get_future().get() > 0);
+        CHECK(second.get_future().get() > 0);
+    }
+    NpzReader reader("coroutines.npz");
+    CHECK(reader.entries().size() == 8);
+    std::promise<NpyArray> loaded, missing;
+    import_array(executor, reader, "a3", loaded);
+    import_array(executor, reader, "b", missing);
+    NpyArray array = loaded.get_future().get();
+    CHECK(std::equal(data.begin(), data.end(), array.data_as<double>()));
+    CHECK_THROWS(missing.get_future().get());
+}
+
+TEST_CASE("Caller executor", "[host]")
+{
+    std::vector<int16_t> large(1536 * 1024);
+    for (size_t i = 0; i < large.size(); ++i) large[i] = static_cast<int16_t>(i % 1000);
+
+    // Counts the tasks it runs
+    struct CountingExecutor : Executor {
+        ThreadPoolExecutor pool{2};
+        std::atomic<size_t> tasks{0};
+        void execute(std::function<void()> task) override {
+            ++tasks;
+            pool.execute(std::move(task));
+        }
+    } counting;
+    // Runs tasks on the calling thread
+    struct InlineExecutor : Executor {
+        void execute(std::function<void()> task) override { task(); }
+    } inline_executor;
+
+    for (Executor* executor : std::initializer_list<Executor*>{&counting, &inline_executor}) {
+        {
+            NpzFile npz("executor.npz");
+            npz.set_num_threads(3);
+            npz.set_executor(executor);
+            npz.add_array("large", large.data(), {large.size()}, 0, CompressionMethod::DEFLATE);
+            npz.add_chunked_array("chunked", large.data(), {large.size()}, {4096});
+        }
+        NpzReader reader("executor.npz");
+        CHECK(std::equal(large.begin(), large.end(), reader.load("large").data_as<int16_t>()));
+        CHECK(std::equal(large.begin(), large.end(), reader.load_chunked("chunked").data_as<int16_t>()));
+    }
+    CHECK(counting.tasks >= 3);  // At least the blocks of the large entry
+
+    // Own threads pinned to CPU 0
+    NpzFile npz("pinned.npz");
+    npz.set_num_threads(2);
+    npz.set_cpu_affinity({0});
+    npz.add_array("large", large.data(), {large.size()}, 0, CompressionMethod::DEFLATE);
+    CHECK_THROWS(ThreadPoolExecutor(1, {-1}));
+}
+
+TEST_CASE("Memory budget", "[host]")
+{
+    MemoryBudget budget(1000);
+    CHECK(budget.try_acquire(600));
+    CHECK_FALSE(budget.try_acquire(600));
+    {
+        REQUIRE(budget.try_acquire(300));
+        MemoryReservation reservation(budget, 300);
+        CHECK(budget.try_acquire(100));
+        CHECK(budget.current() == 1000);
+        reservation.shrink(100);
+        CHECK(budget.current() == 800);
+    }
+    budget.release(700);
+    CHECK(budget.current() == 0);
+    CHECK(budget.peak() == 1000);
+    budget.acquire(5000);  // Larger than the limit, granted as nothing else is held
+    budget.release(5000);
+
+    // Entries that don't fit are compressed straight to the output, in order with the others
+    std::vector<double> big(1 << 20);
+    for (size_t i = 0; i < big.size(); ++i) big[i] = i % 1000;
+    std::vector<int32_t> small(1000, 7);
+    MemoryBudget tight(1 << 20);
+    {
+        NpzFile npz("budget.npz");
+        npz.set_memory_budget(tight);
+        npz.set_num_threads(4);
+        npz.add_array("small0", small.data(), {small.size()}, 0, CompressionMethod::DEFLATE);
+        npz.add_array("big", big.data(), {big.size()}, 0, CompressionMethod::DEFLATE);
+        npz.add_array("small1", small.data(), {small.size()}, 0, CompressionMethod::DEFLATE);
+        npz.close();
+    }
+    CHECK(tight.current() == 0);
+    CHECK(tight.peak() <= tight.limit());
+    NpzReader reader("budget.npz");
+    CHECK(reader.load("big").data_as<double>()[123456] == 456);
+    CHECK(reader.load("small1").data_as<int32_t>()[999] == 7);
+    CHECK(reader.entries().size() == 3);
+
+    // AsyncNpzFile counts its queue and pooled buffers
+    MemoryBudget shared(8 * small.size() * sizeof(int32_t));
+    {
+        AsyncNpzFile npz("budget.npz", SIZE_MAX);
+        npz.file().set_memory_budget(shared);
+        for (int i = 0; i < 50; ++i) {
+            npz.add_array_snapshot("a" + std::to_string(i), small.data(), {small.size()});
+            CHECK(shared.current() <= shared.limit());
+        }
+        npz.close();
+    }
+    CHECK(shared.current() == 0);
+    CHECK(NpzReader("budget.npz").entries().size() == 50);
+}
+
+TEST_CASE("Many small entries", "[host]")
+{
+    const int count = 20000;
+    {
+        NpzFile npz("many.npz");
+        for (int i = 0; i < count; ++i) {
+            int32_t value = i;
+            npz.add_array("a" + std::to_string(i), &value, {1});
+        }
+    }
+    {
+        NpzFile npz("many.npz", OpenMode::APPEND);  // Central directory reloaded into the flat buffer
+        std::vector<int16_t> matrix(12);
+        npz.add_array("matrix", matrix.data(), {3, 4});
+    }
+    NpzReader reader("many.npz");
+    CHECK(reader.entries().size() == count + 1);
+    {
+        // The end record counts entries in 16 bits
+        NpzFile npz("full.npz");
+        npz.reserve_entries(UINT16_MAX, 8);
+        const size_t one[] = {1};
+        for (int i = reader.entries().size(); i < UINT16_MAX; ++i) {
+            int32_t value = i;
+            npz.add_small_array("b" + std::to_string(i), &value, one);
+        }
+        npz.merge_from(reader);
+        CHECK(npz.num_files() == UINT16_MAX);
+        int32_t value = 0;
+        CHECK_THROWS(npz.add_small_array("extra", &value, one));
+        CHECK_THROWS(npz.add_array("extra", &value, {1}, 0, CompressionMethod::DEFLATE));
+    }
+    CHECK(NpzReader("full.npz").entries().size() == UINT16_MAX);
+    CHECK(reader.load("a0").data_as<int32_t>()[0] == 0);
+    CHECK(reader.load("a19999").data_as<int32_t>()[0] == 19999);
+    NpyArray matrix = reader.load("matrix");
+    CHECK(matrix.shape == shape_type{3, 4});
+}
+
+TEST_CASE("Small array fast path", "[host]")
+{
+    float vec[3] = {1, 2, 3};
+    double mat[16];
+    std::iota(mat, mat + 16, 0.0);
+    const size_t vec_shape[] = {3};
+    const size_t mat_shape[] = {4, 4};
+    std::vector<double> big(1000, 0.5);
+    {
+        NpzFile npz("small.npz");
+        npz.reserve_entries(2000);
+        char name[32];
+        auto add = [&](int i) {
+            std::snprintf(name, sizeof(name), "v%d", i);
+            npz.add_small_array(name, vec, vec_shape);
+            std::snprintf(name, sizeof(name), "m%d.npy", i);
+            npz.add_small_array(name, mat, mat_shape, 0, CompressionMethod::DEFLATE);
+        };
+        add(0);
+        size_t before = allocations;
+        for (int i = 1; i < 1000; ++i) add(i);
+        size_t steady_state = allocations - before;
+        CHECK(steady_state == 0);
+        npz.add_small_array("big", big.data(), std::span<const size_t>(shape_type{big.size()}));  // Falls back
+    }
+    NpzReader reader("small.npz");
+    CHECK(reader.entries().size() == 2001);
+    NpyArray v = reader.load("v999");
+    CHECK(v.shape == shape_type{3});
+    CHECK(v.data_as<float>()[2] == 3);
+    NpyArray m = reader.load("m500");
+    CHECK(m.shape == shape_type{4, 4});
+    CHECK(m.data_as<double>()[15] == 15);
+    CHECK(reader.find("m500.npy")->compression == CompressionMethod::DEFLATE);
+    CHECK(reader.load("big").data_as<double>()[999] == 0.5);
+}
+
+TEST_CASE("Compile-time NPY headers", "[host]")
+{
+    static_assert(numpy_descr<double>() == "<f8");
+    static_assert(NpyHeaderFormat<float, 2>::capacity % 64 == 0);
+    char buf[NpyHeaderFormat<float, 2>::capacity];
+    shape_type shapes[] = {{4, 4}, {0, 7}, {123456789012, 1}};
+    for (const shape_type& shape : shapes) {
+        size_t size = NpyHeaderFormat<float, 2>::format(buf, shape);
+        NpyArray array;
+        CHECK(parse_npy_header(buf, size, array) == size);
+        CHECK(size % 64 == 0);
+        CHECK(array.descr == "<f4");
+        CHECK(array.shape == shape);
+    }
+    char scalar[NpyHeaderFormat<int8_t, 0>::capacity];
+    NpyArray array;
+    CHECK(parse_npy_header(scalar, NpyHeaderFormat<int8_t, 0>::format(scalar, {}), array) == 64);
+    CHECK(array.shape.empty());
+
+    // Long shapes make the header longer than the minimum
+    char vector[NpyHeaderFormat<double, 1>::capacity];
+    size_t size = NpyHeaderFormat<double, 1>::format(vector, shape_type{UINT64_MAX});
+    CHECK(size == 128);
+    CHECK(parse_npy_header(vector, size, array) == size);
+    CHECK(array.shape == shape_type{UINT64_MAX});
+}
+
+TEST_CASE("NPY header cache", "[host]")
+{
+    std::vector<float> sample(64);
+    {
+        NpzFile npz("cache.npz");
+        for (int i = 0; i < 100; ++i) {
+            std::fill(sample.begin(), sample.end(), i);
+            npz.add_array("s" + std::to_string(i), sample.data(), {8, 8});
+        }
+        CHECK(npz.header_cache_misses() == 1);
+        CHECK(npz.header_cache_hits() == 99);
+        npz.add_array("flat", sample.data(), {64});
+        npz.add_array("ints", reinterpret_cast<const int32_t*>(sample.data()), {8, 8});
+        CHECK(npz.header_cache_misses() == 3);
+        // Past the cache size the oldest are replaced
+        for (size_t n = 1; n <= 20; ++n) npz.add_array("n" + std::to_string(n), sample.data(), {n});
+        npz.add_array("again", sample.data(), {8, 8});
+        CHECK(npz.header_cache_misses() == 24);
+    }
+    NpzReader reader("cache.npz");
+    CHECK(reader.load("s42").shape == shape_type{8, 8});
+    CHECK(reader.load("s42").data_as<float>()[63] == 42);
+    CHECK(reader.load("flat").shape == shape_type{64});
+    CHECK(reader.load("n20").shape == shape_type{20});
+}
+
+TEST_CASE("NPY 2.0 and 3.0 headers", "[host]")
+{
+    // A header past 64 KiB needs the 32-bit length of NPY 2.0
+    shape_type shape(40000, 1);
+    shape[0] = 3;
+    double values[3] = {1.5, 2.5, 3.5};
+    {
+        NpzFile npz("npy2.npz");
+        npz.add_array("wide", values, shape);
+        npz.add_array("narrow", values, {3});
+    }
+    NpzReader reader("npy2.npz");
+    NpyArray wide = reader.load("wide");
+    CHECK(wide.shape == shape);
+    CHECK(wide.data_as<double>()[2] == 3.5);
+    CHECK(reader.load("narrow").data_as<double>()[0] == 1.5);
+    std::ifstream ifs("npy2.npz", std::ios::binary);
+    std::string content((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+    size_t magic = content.find("\x93NUMPY");
+    REQUIRE(magic != std::string::npos);
+    CHECK(content[magic + 6] == 2);
+
+    // NPY 3.0 has the 2.0 layout
+    std::string dict = "{'descr': '<f4', 'fortran_order': False, 'shape': (2,), }";
+    std::string header = std::string("\x93NUMPY\x03\x00", 8);
+    uint32_t header_len = 64 * 2 - 12;
+    header.append(reinterpret_cast<const char*>(&header_len), 4);
+    header += dict;
+    header.append(64 * 2 - 1 - header.size(), ' ');
+    header += '\n';
+    NpyArray array;
+    CHECK(parse_npy_header(header.data(), header.size(), array) == 128);
+    CHECK(array.shape == shape_type{2});
+    header[6] = 4;
+    CHECK_THROWS(parse_npy_header(header.data(), header.size(), array));
+}
+
+struct Sample {
+    double t;
+    uint32_t id;
+    float pos[3];
+    int16_t flags;  // Not registered, stored as padding
+};
+CNPZ_RECORD(Sample, CNPZ_FIELD(t), CNPZ_FIELD(id), CNPZ_FIELD_AS(pos, "position"))
+
+struct Event {
+    Sample sample;
+    uint8_t kind;
+};
+CNPZ_RECORD(Event, CNPZ_FIELD(sample), CNPZ_FIELD_AS(kind, "\xc3\xa9v"))
+
+TEST_CASE("Structured arrays", "[host]")
+{
+    const std::string sample_descr = "[('t', '<f8'), ('id', '<u4'), ('position', '<f4', (3,)), ('', '|V8')]";
+    CHECK(numpy_descr<Sample>() == sample_descr);
+    CHECK(numpy_descr<Event>() == "[('sample', " + sample_descr + "), ('\xc3\xa9v', '|u1'), ('', '|V7')]");
+
+    std::vector<Sample> samples(100);
+    for (size_t i = 0; i < samples.size(); ++i) samples[i] = {i * 0.5, uint32_t(i), {1.f * i, 2.f, 3.f}, 0};
+    Event event{samples[7], 9};
+    {
+        NpzFile npz("records.npz");
+        npz.add_array("samples", samples.data(), {samples.size()}, 0, CompressionMethod::DEFLATE);
+        npz.add_array("events", &event, {1});
+        npz.add_small_array("few", samples.data(), std::span<const size_t>(shape_type{2}));
+    }
+    NpzReader reader("records.npz");
+    NpyArray loaded = reader.load("samples");
+    CHECK(loaded.descr == sample_descr);
+    CHECK(loaded.shape == shape_type{100});
+    REQUIRE(loaded.data.size() == samples.size() * sizeof(Sample));
+    const Sample& sample = loaded.data_as<Sample>()[42];
+    CHECK(sample.t == 21);
+    CHECK(sample.id == 42);
+    CHECK(sample.pos[0] == 42);
+    CHECK(reader.load("few").data_as<Sample>()[1].id == 1);
+
+    // The UTF-8 field name needs NPY 3.0
+    NpyArray events = reader.load("events");
+    CHECK(events.descr == std::string(numpy_descr<Event>()));
+    CHECK(events.data_as<Event>()->kind == 9);
+    CHECK(events.data_as<Event>()->sample.id == 7);
+    std::ifstream ifs("records.npz", std::ios::binary);
+    std::string content((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+    CHECK(content.find("\x93NUMPY\x03") != std::string::npos);
+}
+
 //
 // TEST_CASE("Simple NPZ", "[host]")
 // {